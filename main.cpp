@@ -2,283 +2,5429 @@
 #include <vector>
 #include <string>
 #include <memory>
-#include <cstdlib>
-#include <ctime>
 #include <stdexcept>
 #include <algorithm>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <array>
+#include <exception>
+#include <type_traits>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <cctype>
+#include <cerrno>
+#include <bit>
+#include <latch>
+#include <future>
+#include <utility>
+#include <coroutine>
+#include <cmath>
+#include <numbers>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 using namespace std ;
 
-// Models
-class Song {
+// Instrumentation. Build with -DSPOTIFY_INSTRUMENT to record hot-path latency
+// and counters; without it the SPOTIFY_* probe macros expand to nothing.
+namespace metrics {
+enum class Probe { ENGINE_PLAY_NEXT, STRATEGY_NEXT_SONG, DEVICE_PLAY_SOUND,
+                   ENGINE_PLAY_BATCH, STRATEGY_FILL_NEXT, DEVICE_PLAY_BATCH, COUNT };
+enum class Counter { PLAYS, THROWS, EMPTY_PLAYLIST, COUNT };
+
+constexpr const char* probeName(Probe p) {
+    constexpr const char* names[] = {"AudioEngine::playNext", "PlayStrategy::getNextSong",
+                                     "IAudioOutputDevice::playSound", "AudioEngine::playMultiple(batch)",
+                                     "PlayStrategy::fillNext", "IAudioOutputDevice::playBatch"};
+    return names[static_cast<size_t>(p)];
+}
+constexpr const char* counterName(Counter c) {
+    constexpr const char* names[] = {"plays", "throws", "empty_playlist"};
+    return names[static_cast<size_t>(c)];
+}
+
+// Log-linear (HDR-style) histogram of nanosecond values: each power of two is
+// split into 16 linear sub-buckets, so the relative error stays under ~6%
+// from 1ns up to hours. Single writer; readers may snapshot concurrently.
+class LatencyHistogram {
 public:
-    string title;
-    string artist;
-    Song(const string& t = "", const string& a = "") : title(t), artist(a) {}
+    static constexpr size_t SUB_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+private:
+    array<atomic<uint64_t>, BUCKETS> counts{};
+public:
+    static size_t bucketOf(uint64_t v) {
+        if (v < SUB_BUCKETS) return static_cast<size_t>(v);
+        size_t magnitude = 63 - static_cast<size_t>(__builtin_clzll(v));   // >= SUB_BITS
+        size_t shift = magnitude - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((v >> shift) & (SUB_BUCKETS - 1));
+    }
+    // Upper bound of the values that land in bucket b
+    static uint64_t bucketLimit(size_t b) {
+        if (b < SUB_BUCKETS) return b;
+        size_t shift = b / SUB_BUCKETS - 1;
+        uint64_t base = (SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+    void record(uint64_t v) {
+        atomic<uint64_t>& c = counts[bucketOf(v)];
+        c.store(c.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    void addTo(vector<uint64_t>& out) const {
+        out.resize(BUCKETS);
+        for (size_t b = 0; b < BUCKETS; ++b) out[b] += counts[b].load(memory_order_relaxed);
+    }
 };
 
-class Playlist {
-    vector<Song> songs;
-public:
-    void addSong(const Song& song) { songs.push_back(song); }
-    void removeSong(size_t index) {
-        if (index < songs.size()) songs.erase(songs.begin() + index);
+struct HistogramSnapshot {
+    vector<uint64_t> counts = vector<uint64_t>(LatencyHistogram::BUCKETS);
+    uint64_t total() const { return accumulate(counts.begin(), counts.end(), uint64_t(0)); }
+    // Value at quantile q in [0, 1] (bucket upper bound); 0 when empty
+    uint64_t percentile(double q) const {
+        uint64_t n = total();
+        if (n == 0) return 0;
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(n) + 0.5));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < counts.size(); ++b) {
+            seen += counts[b];
+            if (seen >= rank) return LatencyHistogram::bucketLimit(b);
+        }
+        return LatencyHistogram::bucketLimit(counts.size() - 1);
     }
-    const vector<Song>& getSongs() const { return songs; }
-    size_t size() const { return songs.size(); }
 };
 
-// Enums
-enum class DeviceType { BLUETOOTH, WIRED, HEADPHONES };
-enum class PlayStrategyType { SEQUENTIAL, RANDOM, CUSTOM_QUEUE };
+struct Snapshot {
+    array<HistogramSnapshot, static_cast<size_t>(Probe::COUNT)> latency;
+    array<uint64_t, static_cast<size_t>(Counter::COUNT)> counters{};
+    const HistogramSnapshot& operator[](Probe p) const { return latency[static_cast<size_t>(p)]; }
+    uint64_t operator[](Counter c) const { return counters[static_cast<size_t>(c)]; }
+};
 
-// External device APIs (simulated)
-class BluetoothSpeakerAPI {
+// Per-thread block; registered once and kept alive after its thread exits so
+// its counts stay in later snapshots
+struct ThreadMetrics {
+    array<LatencyHistogram, static_cast<size_t>(Probe::COUNT)> latency;
+    array<atomic<uint64_t>, static_cast<size_t>(Counter::COUNT)> counters{};
+};
+
+class Registry {
+    mutex m;
+    vector<shared_ptr<ThreadMetrics>> threads;
+    // Custom counters published by other subsystems (e.g. caches), read at snapshot time
+    struct Gauge { uint64_t id; string name; function<uint64_t()> read; };
+    vector<Gauge> gauges;
+    uint64_t nextGaugeId = 0;
 public:
-    void initialize() { /* simulate init */ }
-    void play(const string& data) {
-        cout << "[BluetoothSpeakerAPI] Playing data: " << data << endl;
+    static Registry& instance() {
+        static Registry r;
+        return r;
+    }
+    shared_ptr<ThreadMetrics> registerThread() {
+        auto tm = make_shared<ThreadMetrics>();
+        lock_guard<mutex> lk(m);
+        threads.push_back(tm);
+        return tm;
+    }
+    // Returns an id for removeGauge; prefer GaugeRegistration, which removes on destruction
+    uint64_t addGauge(string name, function<uint64_t()> read) {
+        lock_guard<mutex> lk(m);
+        gauges.push_back({++nextGaugeId, move(name), move(read)});
+        return nextGaugeId;
+    }
+    // Once this returns the gauge's callback is not running and never runs again
+    void removeGauge(uint64_t id) {
+        lock_guard<mutex> lk(m);
+        erase_if(gauges, [id](const Gauge& g) { return g.id == id; });
+    }
+    // Reads every thread's block without pausing writers
+    Snapshot snapshot() {
+        Snapshot snap;
+        lock_guard<mutex> lk(m);
+        for (const auto& tm : threads) {
+            for (size_t p = 0; p < snap.latency.size(); ++p) tm->latency[p].addTo(snap.latency[p].counts);
+            for (size_t c = 0; c < snap.counters.size(); ++c) snap.counters[c] += tm->counters[c].load(memory_order_relaxed);
+        }
+        return snap;
+    }
+    vector<pair<string, uint64_t>> readGauges() {
+        lock_guard<mutex> lk(m);
+        vector<pair<string, uint64_t>> out;
+        for (const Gauge& g : gauges) out.emplace_back(g.name, g.read());
+        return out;
     }
 };
-class WiredSpeakerAPI {
+
+// Owns a set of gauges and removes them from the registry when destroyed, so
+// callbacks never outlive the object they read
+class GaugeRegistration {
+    vector<uint64_t> ids;
 public:
-    void initialize() { /* simulate init */ }
-    void play(const string& data) {
-        cout << "[WiredSpeakerAPI] Playing data: " << data << endl;
+    GaugeRegistration() = default;
+    GaugeRegistration(GaugeRegistration&& o) noexcept : ids(exchange(o.ids, {})) {}
+    GaugeRegistration& operator=(GaugeRegistration&& o) noexcept {
+        if (this != &o) { reset(); ids = exchange(o.ids, {}); }
+        return *this;
+    }
+    ~GaugeRegistration() { reset(); }
+
+    void add(string name, function<uint64_t()> read) {
+        ids.push_back(Registry::instance().addGauge(move(name), move(read)));
+    }
+    void reset() {
+        for (uint64_t id : ids) Registry::instance().removeGauge(id);
+        ids.clear();
     }
 };
-class HeadphonesAPI {
+
+inline ThreadMetrics& local() {
+    static thread_local shared_ptr<ThreadMetrics> tm = Registry::instance().registerThread();
+    return *tm;
+}
+inline void increment(Counter c, uint64_t by = 1) {
+    atomic<uint64_t>& v = local().counters[static_cast<size_t>(c)];
+    v.store(v.load(memory_order_relaxed) + by, memory_order_relaxed);
+}
+inline Snapshot snapshot() { return Registry::instance().snapshot(); }
+
+class ScopedTimer {
+    Probe probe;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
 public:
-    void initialize() { /* simulate init */ }
-    void play(const string& data) {
-        cout << "[HeadphonesAPI] Playing data: " << data << endl;
+    explicit ScopedTimer(Probe p) : probe(p) {}
+    ~ScopedTimer() {
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        local().latency[static_cast<size_t>(probe)].record(static_cast<uint64_t>(ns));
     }
 };
 
-// IAudioOutputDevice interface
-class IAudioOutputDevice {
+// Counts a THROWS event if the enclosing scope is left by an exception
+class ThrowCounter {
+    int active = uncaught_exceptions();
 public:
-    virtual void playSound(const Song& song) = 0;
-    virtual ~IAudioOutputDevice() = default;
+    ~ThrowCounter() {
+        if (uncaught_exceptions() > active) increment(Counter::THROWS);
+    }
 };
 
-// Adapters
-class BluetoothSpeakerAdapter : public IAudioOutputDevice {
-    BluetoothSpeakerAPI api;
-public:
-    BluetoothSpeakerAdapter() { api.initialize(); }
-    void playSound(const Song& song) override {
-        string data = "Bluetooth play: " + song.title + " by " + song.artist;
-        api.play(data);
+inline void print(ostream& os, const Snapshot& snap) {
+    os << left << setw(36) << "probe" << right << setw(10) << "count" << setw(10) << "p50"
+       << setw(10) << "p99" << setw(10) << "p999" << " (ns)\n";
+    for (size_t p = 0; p < snap.latency.size(); ++p) {
+        const HistogramSnapshot& h = snap.latency[p];
+        if (h.total() == 0) continue;
+        os << left << setw(36) << probeName(static_cast<Probe>(p)) << right << setw(10) << h.total()
+           << setw(10) << h.percentile(0.5) << setw(10) << h.percentile(0.99) << setw(10) << h.percentile(0.999) << '\n';
     }
+    for (size_t c = 0; c < snap.counters.size(); ++c)
+        os << left << setw(36) << counterName(static_cast<Counter>(c)) << right << setw(10) << snap.counters[c] << '\n';
+    for (const auto& [name, value] : Registry::instance().readGauges())
+        os << left << setw(36) << name << right << setw(10) << value << '\n';
+}
+}  // namespace metrics
+
+#define SPOTIFY_CONCAT_INNER(a, b) a##b
+#define SPOTIFY_CONCAT(a, b) SPOTIFY_CONCAT_INNER(a, b)
+#ifdef SPOTIFY_INSTRUMENT
+#define SPOTIFY_TIME(probe) metrics::ScopedTimer SPOTIFY_CONCAT(spotifyTimer, __LINE__)(metrics::Probe::probe)
+#define SPOTIFY_COUNT(counter, n) metrics::increment(metrics::Counter::counter, (n))
+#define SPOTIFY_COUNT_IF(cond, counter) do { if (cond) metrics::increment(metrics::Counter::counter); } while (0)
+#define SPOTIFY_COUNT_THROWS() metrics::ThrowCounter SPOTIFY_CONCAT(spotifyThrows, __LINE__)
+#else
+#define SPOTIFY_TIME(probe) ((void)0)
+#define SPOTIFY_COUNT(counter, n) ((void)0)
+#define SPOTIFY_COUNT_IF(cond, counter) ((void)0)
+#define SPOTIFY_COUNT_THROWS() ((void)0)
+#endif
+
+// Models
+using SongId = uint32_t;
+constexpr SongId INVALID_SONG_ID = numeric_limits<SongId>::max();
+
+// Song is a lightweight view.
+// Lifetime: a Song is valid only while the text it points to lives. Songs from
+// SongCatalog::get live as long as the catalog; a Song built from the caller's
+// strings lives only as long as those strings, so add it to a catalog (e.g.
+// addSongToPlaylist) before the strings go. Queueing devices (AsyncOutputDevice,
+// DeviceGroup, LoopOutputDevice) play songs later on another thread, so hand
+// them catalog songs whose catalog outlives the queued output. Building a Song
+// from a temporary std::string, which would dangle at once, does not compile.
+class Song {
+public:
+    string_view title;
+    string_view artist;
+    SongId id;
+    Song(string_view t = "", string_view a = "", SongId i = INVALID_SONG_ID) : title(t), artist(a), id(i) {}
+    template <class T, class U>
+        requires is_same_v<T, string> || is_same_v<U, string>
+    Song(T&&, U&&, SongId = INVALID_SONG_ID) = delete;
+    template <class T>
+        requires is_same_v<T, string>
+    Song(T&&) = delete;
 };
 
-class WiredSpeakerAdapter : public IAudioOutputDevice {
-    WiredSpeakerAPI api;
+// SongCatalog: interns title/artist text once and hands out compact SongId handles.
+// A catalog opened from a CatalogFile (see MappedCatalog) is a read-only view
+// over the mapping instead.
+class SongCatalog {
 public:
-    WiredSpeakerAdapter() { api.initialize(); }
-    void playSound(const Song& song) override {
-        string data = "Wired play: " + song.title + " by " + song.artist;
-        api.play(data);
+    struct SongRecord { uint32_t title; uint32_t artist; };  // interned text ids
+    struct TextRef { uint32_t offset; uint32_t length; };     // text table entry in a CatalogFile
+private:
+    // Text lives in a per-catalog arena: bump-pointer copies into large blocks,
+    // never moved or freed individually, so views never dangle
+    pmr::monotonic_buffer_resource textArena{64 * 1024};
+    vector<string_view> texts;                 // text id -> interned text
+    unordered_map<string_view, uint32_t> textIds;
+    vector<SongRecord> records;                // SongId -> record
+    unordered_map<uint64_t, SongId> songIds;   // (title id, artist id) -> SongId
+    bool mapped = false;
+    const SongRecord* mappedRecords = nullptr;
+    const TextRef* mappedTexts = nullptr;
+    const char* mappedBlob = nullptr;
+    size_t mappedSongCount = 0, mappedTextCount = 0;
+    friend class CatalogFile;
+    friend class MappedCatalog;
+
+    uint32_t intern(string_view text) {
+        auto it = textIds.find(text);
+        if (it != textIds.end()) return it->second;
+        char* stored = static_cast<char*>(textArena.allocate(max<size_t>(text.size(), 1), 1));
+        memcpy(stored, text.data(), text.size());
+        uint32_t id = static_cast<uint32_t>(texts.size());
+        texts.push_back(string_view(stored, text.size()));
+        textIds.emplace(texts.back(), id);
+        return id;
+    }
+    string_view text(uint32_t id) const {
+        if (!mapped) return texts[id];
+        const TextRef& ref = mappedTexts[id];
+        return string_view(mappedBlob + ref.offset, ref.length);
+    }
+    size_t textCount() const { return mapped ? mappedTextCount : texts.size(); }
+    const SongRecord& record(SongId id) const { return mapped ? mappedRecords[id] : records[id]; }
+public:
+    SongCatalog() = default;
+    SongCatalog(const SongCatalog&) = delete;
+    SongCatalog& operator=(const SongCatalog&) = delete;
+
+    // Adding the same (title, artist) twice returns the existing id
+    SongId addSong(string_view title, string_view artist) {
+        if (mapped) throw runtime_error("Memory-mapped song catalog is read-only");
+        uint32_t t = intern(title), a = intern(artist);
+        uint64_t key = (static_cast<uint64_t>(t) << 32) | a;
+        auto it = songIds.find(key);
+        if (it != songIds.end()) return it->second;
+        if (records.size() >= INVALID_SONG_ID) throw runtime_error("Song catalog is full");
+        SongId id = static_cast<SongId>(records.size());
+        records.push_back({t, a});
+        songIds.emplace(key, id);
+        return id;
+    }
+    SongId addSong(const Song& song) { return addSong(song.title, song.artist); }
+    Song get(SongId id) const {
+        const SongRecord& r = record(id);
+        return Song(text(r.title), text(r.artist), id);
+    }
+    size_t size() const { return mapped ? mappedSongCount : records.size(); }
+    bool isMapped() const { return mapped; }
+    // Interned text ids, for columnar scans that compare ids instead of strings
+    uint32_t titleIdOf(SongId id) const { return record(id).title; }
+    uint32_t artistIdOf(SongId id) const { return record(id).artist; }
+    // Mapped catalogs have no hash index, so they fall back to a scan of the text table
+    optional<uint32_t> findText(string_view text) const {
+        if (!mapped) {
+            auto it = textIds.find(text);
+            return it == textIds.end() ? nullopt : optional<uint32_t>(it->second);
+        }
+        for (uint32_t t = 0; t < mappedTextCount; ++t)
+            if (this->text(t) == text) return t;
+        return nullopt;
     }
 };
 
-class HeadphonesAdapter : public IAudioOutputDevice {
-    HeadphonesAPI api;
+// SHIFT erases in place (O(n), later indices move down); TOMBSTONE marks the
+// slot as removed in O(1) so outstanding queue positions stay valid until compact()
+enum class RemovalMode { SHIFT, TOMBSTONE };
+
+// Playlist stores SongId handles and resolves them through its catalog.
+// Indices are slot positions; in TOMBSTONE mode a removed slot holds INVALID_SONG_ID.
+// A playlist may also borrow its slots (e.g. from a memory-mapped CatalogFile);
+// the first edit copies them into owned storage.
+class Playlist {
+    const SongCatalog* catalog = nullptr;
+    vector<SongId> songs;          // owned slots
+    span<const SongId> slots;      // what readers see: songs, or the borrowed array
+    bool borrowed = false;
+    size_t liveCount = 0;
+    RemovalMode removalMode = RemovalMode::SHIFT;
+    uint64_t generation = 0;       // bumped by every change to the slots
+    uint64_t layoutGeneration = 0; // follows generation, except when a change only tombstones a slot
+
+    vector<SongId>& own() {
+        if (borrowed) {
+            songs.assign(slots.begin(), slots.end());
+            borrowed = false;
+        }
+        return songs;
+    }
+    void publish(bool layoutChange = true) {
+        slots = songs;
+        ++generation;
+        if (layoutChange) layoutGeneration = generation;
+    }
+    void copyFrom(const Playlist& o) {
+        ++generation;
+        catalog = o.catalog;
+        borrowed = o.borrowed;
+        liveCount = o.liveCount;
+        removalMode = o.removalMode;
+        slots = o.slots;
+        if (!borrowed) publish();
+        layoutGeneration = generation;
+    }
 public:
-    HeadphonesAdapter() { api.initialize(); }
-    void playSound(const Song& song) override {
-        string data = "Headphones play: " + song.title + " by " + song.artist;
-        api.play(data);
+    static constexpr size_t REMOVED = numeric_limits<size_t>::max();
+
+    explicit Playlist(const SongCatalog& c) : catalog(&c) {}
+    // Zero-copy view over ids that outlive the playlist; they must hold no tombstones
+    Playlist(const SongCatalog& c, span<const SongId> view)
+        : catalog(&c), slots(view), borrowed(true), liveCount(view.size()) {}
+    Playlist(const Playlist& o) : songs(o.songs) { copyFrom(o); }
+    Playlist(Playlist&& o) noexcept : songs(move(o.songs)) { copyFrom(o); o.slots = {}; o.liveCount = 0; o.layoutGeneration = ++o.generation; }
+    Playlist& operator=(const Playlist& o) {
+        if (this != &o) { songs = o.songs; copyFrom(o); }
+        return *this;
+    }
+    Playlist& operator=(Playlist&& o) noexcept {
+        if (this != &o) { songs = move(o.songs); copyFrom(o); o.slots = {}; o.liveCount = 0; o.layoutGeneration = ++o.generation; }
+        return *this;
+    }
+
+    void addSong(SongId id) { own().push_back(id); publish(); ++liveCount; }
+    // Appends a batch of ids. insert grows the storage geometrically, so a
+    // stream of batches (e.g. an import) stays linear overall
+    void addSongs(span<const SongId> ids) {
+        vector<SongId>& owned = own();
+        owned.insert(owned.end(), ids.begin(), ids.end());
+        publish();
+        liveCount += ids.size();
     }
+    void removeSong(size_t index) {
+        if (!isLive(index)) return;
+        vector<SongId>& owned = own();
+        if (removalMode == RemovalMode::TOMBSTONE) owned[index] = INVALID_SONG_ID;
+        else owned.erase(owned.begin() + index);
+        publish(removalMode != RemovalMode::TOMBSTONE);
+        --liveCount;
+    }
+    void setRemovalMode(RemovalMode mode) {
+        if (mode == RemovalMode::SHIFT && liveCount != slots.size()) compact();
+        removalMode = mode;
+    }
+    RemovalMode getRemovalMode() const { return removalMode; }
+    // Tombstones outnumber live songs; compaction would at least halve the slots
+    bool needsCompaction() const { return slots.size() - liveCount > liveCount; }
+    // Drops tombstones and returns the old slot -> new slot mapping (REMOVED for
+    // dropped slots). Shifts indices, so callers holding positions must remap.
+    vector<size_t> compact() {
+        vector<SongId>& owned = own();
+        vector<size_t> remap(owned.size(), REMOVED);
+        size_t out = 0;
+        for (size_t i = 0; i < owned.size(); ++i) {
+            if (owned[i] == INVALID_SONG_ID) continue;
+            remap[i] = out;
+            owned[out++] = owned[i];
+        }
+        owned.resize(out);
+        publish();
+        return remap;
+    }
+    bool isLive(size_t index) const { return index < slots.size() && slots[index] != INVALID_SONG_ID; }
+    Song getSong(size_t index) const { return catalog->get(slots[index]); }
+    span<const SongId> getSongs() const { return slots; }
+    const SongCatalog& getCatalog() const { return *catalog; }
+    size_t size() const { return liveCount; }
+    size_t slotCount() const { return slots.size(); }
+    bool isBorrowed() const { return borrowed; }
+    // Changes whenever slots are added, removed or moved, so cached positions
+    // and cursors can tell they are stale
+    uint64_t getGeneration() const { return generation; }
+    // Unchanged while the only edits are tombstones, so a live slot still holds
+    // the same song at the same index; structures over slots can then skip dead
+    // slots instead of rebuilding
+    uint64_t getLayoutGeneration() const { return layoutGeneration; }
+
+    // Iterates live songs in slot order, skipping tombstones
+    class const_iterator {
+        const Playlist* playlist = nullptr;
+        size_t slot = 0;
+        void skipRemoved() { while (slot < playlist->slotCount() && !playlist->isLive(slot)) ++slot; }
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = Song;
+        using difference_type = ptrdiff_t;
+        using pointer = void;
+        using reference = Song;
+        const_iterator() = default;
+        const_iterator(const Playlist* pl, size_t s) : playlist(pl), slot(s) { skipRemoved(); }
+        Song operator*() const { return playlist->getSong(slot); }
+        size_t slotIndex() const { return slot; }
+        const_iterator& operator++() { ++slot; skipRemoved(); return *this; }
+        const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+        bool operator==(const const_iterator& o) const { return slot == o.slot; }
+    };
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, slots.size()); }
 };
 
-// DeviceFactory
-class DeviceFactory {
+// Shared playlists (RCU): readers pin an immutable snapshot, and edit() copies
+// the current version, applies the change and publishes the copy with one
+// pointer swap. Readers never wait on an edit; a snapshot lives until its last holder drops it, so any
+// number of sessions share one copy. Copying a borrowed playlist copies only
+// the view. The catalog is not versioned: add songs to it before sharing them.
+using PlaylistSnapshot = shared_ptr<const Playlist>;
+
+class SharedPlaylist {
+    PlaylistSnapshot current;
+    mutable mutex publishMutex;   // guards only the pointer swap/copy, never an edit
+    atomic<uint64_t> version{0};
+    mutex writeMutex;
 public:
-    static unique_ptr<IAudioOutputDevice> create(DeviceType type) {
-        switch (type) {
-            case DeviceType::BLUETOOTH:
-                return make_unique<BluetoothSpeakerAdapter>();
-            case DeviceType::WIRED:
-                return make_unique<WiredSpeakerAdapter>();
-            case DeviceType::HEADPHONES:
-                return make_unique<HeadphonesAdapter>();
-            default:
-                return nullptr;
+    explicit SharedPlaylist(Playlist initial) : current(make_shared<const Playlist>(move(initial))) {}
+    PlaylistSnapshot snapshot() const { lock_guard<mutex> lock(publishMutex); return current; }
+    // Bumped after each publish; cheap to poll before re-pinning
+    uint64_t getVersion() const { return version.load(memory_order_acquire); }
+    // Batches all of fn's changes into one new version; writers are serialized
+    // with each other but readers only wait for the final pointer swap
+    template <class F>
+    PlaylistSnapshot edit(F&& fn) {
+        lock_guard<mutex> lock(writeMutex);
+        auto next = make_shared<Playlist>(*snapshot());
+        fn(*next);
+        PlaylistSnapshot published = move(next);
+        PlaylistSnapshot retired;
+        {
+            lock_guard<mutex> swapLock(publishMutex);
+            retired = exchange(current, published);
         }
+        version.fetch_add(1, memory_order_release);
+        return published;
     }
 };
 
-// PlayStrategy interface
-class PlayStrategy {
-public:
-    virtual const Song& getNextSong(const Playlist& playlist) = 0;
-    virtual void reset() = 0;
-    virtual ~PlayStrategy() = default;
+// Binary catalog format: header, text table (offset/length refs plus one text
+// blob), fixed-width song records, playlist refs and playlist index arrays.
+// Sections are 8-byte aligned and stored in host byte order, so a mapped file
+// is used in place with no parsing.
+struct CatalogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t textCount, textBytes, songCount, playlistCount, entryCount;
 };
+struct CatalogPlaylistRef { uint64_t first; uint64_t count; };  // range in the entry array
 
-// Sequential strategy
-class SequentialPlayStrategy : public PlayStrategy {
-    size_t index = 0;
+class CatalogFile {
 public:
-    const Song& getNextSong(const Playlist& playlist) override {
-        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
-        const Song& s = playlist.getSongs()[index % playlist.size()];
-        index = (index + 1) % playlist.size();
-        return s;
+    static constexpr char MAGIC[8] = {'S', 'P', 'O', 'T', 'C', 'A', 'T', '\0'};
+    static constexpr uint32_t VERSION = 1;
+
+    // Byte offset of each section from the start of the file
+    struct Layout { uint64_t texts, blob, songs, playlists, entries, total; };
+    static uint64_t align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+    // nullopt unless every section ends within limit. Each step checks the
+    // running offset against limit first, so no product or sum can overflow.
+    static optional<Layout> checkedLayout(const CatalogFileHeader& h, uint64_t limit) {
+        uint64_t at = align8(sizeof(CatalogFileHeader));
+        auto section = [&](uint64_t count, uint64_t width) {
+            if (at > limit || count > (limit - at) / width) return false;
+            at = align8(at + count * width);
+            return true;
+        };
+        Layout l;
+        l.texts = at;
+        if (!section(h.textCount, sizeof(SongCatalog::TextRef))) return nullopt;
+        l.blob = at;
+        if (!section(h.textBytes, 1)) return nullopt;
+        l.songs = at;
+        if (!section(h.songCount, sizeof(SongCatalog::SongRecord))) return nullopt;
+        l.playlists = at;
+        if (!section(h.playlistCount, sizeof(CatalogPlaylistRef))) return nullopt;
+        l.entries = at;
+        if (!section(h.entryCount, sizeof(SongId))) return nullopt;
+        l.total = at;
+        if (l.total > limit) return nullopt;
+        return l;
+    }
+    static Layout layout(const CatalogFileHeader& h) {
+        optional<Layout> l = checkedLayout(h, numeric_limits<uint64_t>::max() & ~uint64_t(7));
+        if (!l) throw runtime_error("Catalog is too large");
+        return *l;
+    }
+
+    // Writes the catalog and the live songs of each playlist (tombstones dropped)
+    static void write(const string& path, const SongCatalog& catalog, span<const Playlist* const> playlists) {
+        CatalogFileHeader h{};
+        copy(begin(MAGIC), end(MAGIC), h.magic);
+        h.version = VERSION;
+        h.textCount = catalog.textCount();
+        h.songCount = catalog.size();
+        h.playlistCount = playlists.size();
+        vector<SongCatalog::TextRef> refs(h.textCount);
+        for (size_t i = 0; i < h.textCount; ++i) {
+            string_view t = catalog.text(static_cast<uint32_t>(i));
+            if (h.textBytes + t.size() > numeric_limits<uint32_t>::max())
+                throw runtime_error("Catalog text exceeds 4 GiB");
+            refs[i] = {static_cast<uint32_t>(h.textBytes), static_cast<uint32_t>(t.size())};
+            h.textBytes += t.size();
+        }
+        vector<CatalogPlaylistRef> lists;
+        for (const Playlist* pl : playlists) {
+            if (&pl->getCatalog() != &catalog) throw runtime_error("Playlist belongs to another catalog");
+            lists.push_back({h.entryCount, pl->size()});
+            h.entryCount += pl->size();
+        }
+        Layout l = layout(h);
+
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) throw runtime_error("Cannot open " + path);
+        auto pad = [&](uint64_t offset) {
+            static const char zeros[8] = {};
+            out.write(zeros, static_cast<streamsize>(offset - static_cast<uint64_t>(out.tellp())));
+        };
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        pad(l.texts);
+        out.write(reinterpret_cast<const char*>(refs.data()), static_cast<streamsize>(refs.size() * sizeof(refs[0])));
+        pad(l.blob);
+        for (size_t i = 0; i < h.textCount; ++i) {
+            string_view t = catalog.text(static_cast<uint32_t>(i));
+            out.write(t.data(), static_cast<streamsize>(t.size()));
+        }
+        pad(l.songs);
+        for (size_t id = 0; id < h.songCount; ++id) {
+            const SongCatalog::SongRecord& r = catalog.record(static_cast<SongId>(id));
+            out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+        }
+        pad(l.playlists);
+        out.write(reinterpret_cast<const char*>(lists.data()), static_cast<streamsize>(lists.size() * sizeof(lists[0])));
+        for (const Playlist* pl : playlists)
+            for (SongId id : pl->getSongs())
+                if (id != INVALID_SONG_ID) out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+        pad(l.total);
+        if (!out) throw runtime_error("Failed to write " + path);
     }
-    void reset() override { index = 0; }
 };
 
-// Random strategy
-class RandomPlayStrategy : public PlayStrategy {
+// MappedFile: read-only shared mapping, so pages are shared by every process
+// that maps the same catalog
+class MappedFile {
+    void* base = MAP_FAILED;
+    size_t length = 0;
 public:
-    RandomPlayStrategy() { srand(static_cast<unsigned>(time(nullptr))); }
-    const Song& getNextSong(const Playlist& playlist) override {
-        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
-        size_t idx = rand() % playlist.size();
-        return playlist.getSongs()[idx];
+    explicit MappedFile(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("Cannot open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) { ::close(fd); throw runtime_error("Cannot stat " + path); }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) base = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) throw runtime_error("Cannot map " + path);
     }
-    void reset() override {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { if (base != MAP_FAILED) ::munmap(base, length); }
+    const char* data() const { return static_cast<const char*>(base); }
+    size_t size() const { return length; }
 };
 
-// Custom queue strategy
-class CustomQueueStrategy : public PlayStrategy {
-    vector<size_t> queueIndices;
-    size_t pos = 0;
+// MappedCatalog: opens a CatalogFile and exposes its catalog and playlists as
+// zero-copy views. Open bounds every section against the file size and every
+// text ref, song record, playlist range and entry against its table, so a
+// truncated or hostile file is rejected before any lookup reads past the mapping.
+class MappedCatalog {
+    MappedFile file;
+    SongCatalog catalog;
+    const CatalogPlaylistRef* playlistRefs = nullptr;
+    const SongId* entries = nullptr;
+    size_t playlistTotal = 0;
 public:
-    void setQueue(const vector<size_t>& q) {
-        queueIndices = q;
-        pos = 0;
+    explicit MappedCatalog(const string& path) : file(path) {
+        if (file.size() < sizeof(CatalogFileHeader)) throw runtime_error("Not a catalog file: " + path);
+        const char* base = file.data();
+        const auto& h = *reinterpret_cast<const CatalogFileHeader*>(base);
+        if (!equal(begin(CatalogFile::MAGIC), end(CatalogFile::MAGIC), h.magic) || h.version != CatalogFile::VERSION)
+            throw runtime_error("Not a catalog file: " + path);
+        optional<CatalogFile::Layout> checked = CatalogFile::checkedLayout(h, file.size());
+        if (!checked) throw runtime_error("Truncated catalog file: " + path);
+        const CatalogFile::Layout& l = *checked;
+        if (h.textCount > numeric_limits<uint32_t>::max() || h.songCount >= INVALID_SONG_ID)
+            throw runtime_error("Corrupt catalog header in " + path);
+        auto corrupt = [&](const char* what) { return runtime_error(string("Corrupt ") + what + " in " + path); };
+        const auto* texts = reinterpret_cast<const SongCatalog::TextRef*>(base + l.texts);
+        for (uint64_t i = 0; i < h.textCount; ++i)
+            if (uint64_t(texts[i].offset) + texts[i].length > h.textBytes) throw corrupt("text table");
+        const auto* records = reinterpret_cast<const SongCatalog::SongRecord*>(base + l.songs);
+        for (uint64_t i = 0; i < h.songCount; ++i)
+            if (records[i].title >= h.textCount || records[i].artist >= h.textCount) throw corrupt("song table");
+        const auto* refs = reinterpret_cast<const CatalogPlaylistRef*>(base + l.playlists);
+        for (uint64_t i = 0; i < h.playlistCount; ++i)
+            if (refs[i].first > h.entryCount || refs[i].count > h.entryCount - refs[i].first) throw corrupt("playlist table");
+        const auto* ids = reinterpret_cast<const SongId*>(base + l.entries);
+        for (uint64_t i = 0; i < h.entryCount; ++i)
+            if (ids[i] >= h.songCount) throw corrupt("playlist entries");
+        catalog.mapped = true;
+        catalog.mappedTexts = reinterpret_cast<const SongCatalog::TextRef*>(base + l.texts);
+        catalog.mappedTextCount = h.textCount;
+        catalog.mappedBlob = base + l.blob;
+        catalog.mappedRecords = reinterpret_cast<const SongCatalog::SongRecord*>(base + l.songs);
+        catalog.mappedSongCount = h.songCount;
+        playlistRefs = reinterpret_cast<const CatalogPlaylistRef*>(base + l.playlists);
+        entries = reinterpret_cast<const SongId*>(base + l.entries);
+        playlistTotal = h.playlistCount;
     }
-    const Song& getNextSong(const Playlist& playlist) override {
-        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
-        if (queueIndices.empty()) throw runtime_error("Custom queue is empty");
-        size_t idx = queueIndices[pos % queueIndices.size()];
-        if (idx >= playlist.size()) throw runtime_error("Queue index out of range");
-        const Song& s = playlist.getSongs()[idx];
-        pos = (pos + 1) % queueIndices.size();
-        return s;
+    MappedCatalog(const MappedCatalog&) = delete;
+    MappedCatalog& operator=(const MappedCatalog&) = delete;
+    const SongCatalog& getCatalog() const { return catalog; }
+    size_t playlistCount() const { return playlistTotal; }
+    Playlist getPlaylist(size_t index) const {
+        if (index >= playlistTotal) throw runtime_error("Playlist index out of range");
+        const CatalogPlaylistRef& r = playlistRefs[index];
+        return Playlist(catalog, span<const SongId>(entries + r.first, r.count));
     }
-    void reset() override { pos = 0; }
 };
 
-// Managers
-class PlaylistManager {
-    Playlist playlist;
-public:
-    void addSong(const Song& song) { playlist.addSong(song); }
-    void removeSong(size_t index) { playlist.removeSong(index); }
-    const Playlist& getPlaylist() const { return playlist; }
-};
+// Streaming playlist import/export. Input is read in fixed-size chunks and fed
+// to the playlist in bounded batches, so memory stays flat apart from the
+// catalog and the 4-byte ids themselves. CSV is "title,artist" per line with
+// optional double quotes ("" escapes a quote; quoted fields may span lines);
+// CSV_HEADER is the same with a header row first, which import skips whatever
+// it holds. JSONL is one {"title": ..., "artist": ...} object per line.
+// BINARY is the CatalogFile format; import reads its first playlist.
+enum class PlaylistFormat { CSV, CSV_HEADER, JSONL, BINARY };
 
-class DeviceManager {
-    unique_ptr<IAudioOutputDevice> device;
+class PlaylistReader {
 public:
-    void selectDevice(DeviceType type) {
-        device = DeviceFactory::create(type);
-        if (!device) throw runtime_error("Failed to create device");
+    static constexpr size_t CHUNK_BYTES = 1 << 16;
+    static constexpr size_t BATCH_SONGS = 4096;
+
+    // Returns the number of songs appended to playlist
+    static size_t import(const string& path, PlaylistFormat format, SongCatalog& catalog, Playlist& playlist) {
+        if (&playlist.getCatalog() != &catalog) throw runtime_error("Playlist belongs to another catalog");
+        if (format == PlaylistFormat::BINARY) return importBinary(path, catalog, playlist);
+        ifstream in(path, ios::binary);
+        if (!in) throw runtime_error("Cannot open " + path);
+        vector<SongId> batch;
+        batch.reserve(BATCH_SONGS);
+        string title, artist;
+        bool csv = format == PlaylistFormat::CSV || format == PlaylistFormat::CSV_HEADER;
+        size_t imported = 0, lineNo = 0;
+        auto flush = [&] {
+            playlist.addSongs(batch);
+            imported += batch.size();
+            batch.clear();
+        };
+        auto onLine = [&](string_view line) {
+            ++lineNo;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (format == PlaylistFormat::CSV_HEADER && lineNo == 1) return;
+            if (line.empty()) return;
+            bool ok = csv ? parseCsv(line, title, artist) : parseJson(line, title, artist);
+            if (!ok) throw runtime_error("Malformed line " + to_string(lineNo) + " in " + path);
+            batch.push_back(catalog.addSong(title, artist));
+            if (batch.size() == BATCH_SONGS) flush();
+        };
+        // Chunked scan; a partial trailing record is carried over to the next chunk.
+        // Quote parity tells a CSV line break inside a quoted field from a record end.
+        vector<char> buffer(CHUNK_BYTES);
+        size_t carried = 0;
+        bool inQuotes = false;
+        for (;;) {
+            if (carried == buffer.size()) buffer.resize(buffer.size() * 2);   // record longer than a chunk
+            in.read(buffer.data() + carried, static_cast<streamsize>(buffer.size() - carried));
+            size_t filled = carried + static_cast<size_t>(in.gcount());
+            if (filled == carried) break;
+            size_t start = 0;
+            for (size_t i = carried; i < filled; ++i) {
+                if (buffer[i] == '"' && csv) inQuotes = !inQuotes;
+                if (buffer[i] != '\n' || inQuotes) continue;
+                onLine(string_view(buffer.data() + start, i - start));
+                start = i + 1;
+            }
+            carried = filled - start;
+            memmove(buffer.data(), buffer.data() + start, carried);
+        }
+        if (carried > 0) onLine(string_view(buffer.data(), carried));
+        flush();
+        return imported;
+    }
+
+private:
+    static size_t importBinary(const string& path, SongCatalog& catalog, Playlist& playlist) {
+        MappedCatalog source(path);
+        if (source.playlistCount() == 0) return 0;
+        Playlist input = source.getPlaylist(0);
+        vector<SongId> batch;
+        batch.reserve(BATCH_SONGS);
+        for (Song s : input) {
+            batch.push_back(catalog.addSong(s.title, s.artist));
+            if (batch.size() == BATCH_SONGS) { playlist.addSongs(batch); batch.clear(); }
+        }
+        playlist.addSongs(batch);
+        return input.size();
+    }
+    static bool parseCsvField(string_view line, size_t& pos, string& out) {
+        out.clear();
+        if (pos < line.size() && line[pos] == '"') {
+            for (++pos; pos < line.size(); ++pos) {
+                if (line[pos] != '"') { out += line[pos]; continue; }
+                if (pos + 1 < line.size() && line[pos + 1] == '"') { out += '"'; ++pos; continue; }
+                ++pos;
+                return pos == line.size() || line[pos] == ',';
+            }
+            return false;   // unterminated quote
+        }
+        size_t end = line.find(',', pos);
+        if (end == string_view::npos) end = line.size();
+        out.append(line.substr(pos, end - pos));
+        pos = end;
+        return true;
+    }
+    static bool parseCsv(string_view line, string& title, string& artist) {
+        size_t pos = 0;
+        if (!parseCsvField(line, pos, title) || pos >= line.size()) return false;
+        ++pos;
+        return parseCsvField(line, pos, artist) && pos == line.size();
+    }
+    static void skipSpace(string_view line, size_t& pos) {
+        while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t')) ++pos;
+    }
+    static void appendUtf8(string& out, uint32_t cp) {
+        if (cp < 0x80) out += static_cast<char>(cp);
+        else if (cp < 0x800) { out += static_cast<char>(0xC0 | (cp >> 6)); out += static_cast<char>(0x80 | (cp & 0x3F)); }
+        else { out += static_cast<char>(0xE0 | (cp >> 12)); out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+               out += static_cast<char>(0x80 | (cp & 0x3F)); }
+    }
+    static bool parseJsonString(string_view line, size_t& pos, string& out) {
+        out.clear();
+        if (pos >= line.size() || line[pos] != '"') return false;
+        for (++pos; pos < line.size(); ++pos) {
+            char c = line[pos];
+            if (c == '"') { ++pos; return true; }
+            if (c != '\\') { out += c; continue; }
+            if (++pos >= line.size()) return false;
+            switch (line[pos]) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (pos + 4 >= line.size()) return false;
+                    uint32_t cp = 0;
+                    for (int i = 1; i <= 4; ++i) {
+                        char h = line[pos + i];
+                        cp <<= 4;
+                        if (h >= '0' && h <= '9') cp |= static_cast<uint32_t>(h - '0');
+                        else if (h >= 'a' && h <= 'f') cp |= static_cast<uint32_t>(h - 'a' + 10);
+                        else if (h >= 'A' && h <= 'F') cp |= static_cast<uint32_t>(h - 'A' + 10);
+                        else return false;
+                    }
+                    appendUtf8(out, cp);
+                    pos += 4;
+                    break;
+                }
+                default: out += line[pos]; break;   // \" \\ \/
+            }
+        }
+        return false;
+    }
+    // Flat objects only; keys other than title/artist may hold strings or scalars
+    static bool parseJson(string_view line, string& title, string& artist) {
+        string key, value;
+        bool haveTitle = false, haveArtist = false;
+        size_t pos = 0;
+        skipSpace(line, pos);
+        if (pos >= line.size() || line[pos++] != '{') return false;
+        for (;;) {
+            skipSpace(line, pos);
+            if (pos < line.size() && line[pos] == '}') break;
+            if (!parseJsonString(line, pos, key)) return false;
+            skipSpace(line, pos);
+            if (pos >= line.size() || line[pos++] != ':') return false;
+            skipSpace(line, pos);
+            if (pos < line.size() && line[pos] == '"') {
+                if (!parseJsonString(line, pos, value)) return false;
+                if (key == "title") { title = value; haveTitle = true; }
+                else if (key == "artist") { artist = value; haveArtist = true; }
+            } else {
+                while (pos < line.size() && line[pos] != ',' && line[pos] != '}') ++pos;
+            }
+            skipSpace(line, pos);
+            if (pos < line.size() && line[pos] == ',') { ++pos; continue; }
+            if (pos < line.size() && line[pos] == '}') break;
+            return false;
+        }
+        return haveTitle && haveArtist;
     }
-    IAudioOutputDevice* getDevice() const { return device.get(); }
 };
 
-class StrategyManager {
+class PlaylistWriter {
 public:
-    static unique_ptr<PlayStrategy> createStrategy(PlayStrategyType type) {
-        switch (type) {
-            case PlayStrategyType::SEQUENTIAL:
-                return make_unique<SequentialPlayStrategy>();
-            case PlayStrategyType::RANDOM:
-                return make_unique<RandomPlayStrategy>();
-            case PlayStrategyType::CUSTOM_QUEUE:
-                return make_unique<CustomQueueStrategy>();
-            default:
-                return nullptr;
+    // Streams the live songs of playlist to path; returns the number written
+    static size_t exportTo(const string& path, PlaylistFormat format, const Playlist& playlist) {
+        if (format == PlaylistFormat::BINARY) {
+            const Playlist* one[] = {&playlist};
+            CatalogFile::write(path, playlist.getCatalog(), one);
+            return playlist.size();
+        }
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) throw runtime_error("Cannot open " + path);
+        string line;
+        size_t written = 0;
+        bool csv = format == PlaylistFormat::CSV || format == PlaylistFormat::CSV_HEADER;
+        if (format == PlaylistFormat::CSV_HEADER) out << "title,artist\n";
+        for (Song s : playlist) {
+            line.clear();
+            if (csv) {
+                appendCsv(line, s.title);
+                line += ',';
+                appendCsv(line, s.artist);
+            } else {
+                line += "{\"title\": ";
+                appendJson(line, s.title);
+                line += ", \"artist\": ";
+                appendJson(line, s.artist);
+                line += '}';
+            }
+            line += '\n';
+            out.write(line.data(), static_cast<streamsize>(line.size()));
+            ++written;
+        }
+        if (!out) throw runtime_error("Failed to write " + path);
+        return written;
+    }
+private:
+    static void appendCsv(string& out, string_view field) {
+        if (field.find_first_of(",\"\r\n") == string_view::npos) { out.append(field); return; }
+        out += '"';
+        for (char c : field) {
+            if (c == '"') out += '"';
+            out += c;
         }
+        out += '"';
+    }
+    static void appendJson(string& out, string_view text) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (char c : text) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (c == '"' || c == '\\') { out += '\\'; out += c; }
+            else if (c == '\n') out += "\\n";
+            else if (c == '\t') out += "\\t";
+            else if (u < 0x20) { out += "\\u00"; out += hex[u >> 4]; out += hex[u & 0xF]; }
+            else out += c;
+        }
+        out += '"';
     }
 };
 
-// AudioEngine
-class AudioEngine {
+// Columnar scan kernels. Each predicate has a scalar form plus an AVX2 (8 lanes)
+// or NEON (4 lanes) form, picked at compile time; -mavx2 or -march=native
+// enables the AVX2 path. Lanes whose flags intersect excludeFlags never match.
+namespace scan {
+struct EqualTo {
+    uint32_t value;
+    bool scalar(uint32_t v) const { return v == value; }
+#if defined(__AVX2__)
+    __m256i lanes(__m256i v) const { return _mm256_cmpeq_epi32(v, _mm256_set1_epi32(static_cast<int>(value))); }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint32x4_t lanes(uint32x4_t v) const { return vceqq_u32(v, vdupq_n_u32(value)); }
+#endif
+};
+
+// Inclusive [lo, hi], unsigned
+struct InRange {
+    uint32_t lo, hi;
+    bool scalar(uint32_t v) const { return v >= lo && v <= hi; }
+#if defined(__AVX2__)
+    __m256i lanes(__m256i v) const {
+        __m256i geLo = _mm256_cmpeq_epi32(_mm256_max_epu32(v, _mm256_set1_epi32(static_cast<int>(lo))), v);
+        __m256i leHi = _mm256_cmpeq_epi32(_mm256_min_epu32(v, _mm256_set1_epi32(static_cast<int>(hi))), v);
+        return _mm256_and_si256(geLo, leHi);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint32x4_t lanes(uint32x4_t v) const { return vandq_u32(vcgeq_u32(v, vdupq_n_u32(lo)), vcleq_u32(v, vdupq_n_u32(hi))); }
+#endif
+};
+
+// Calls emit(baseIndex, bitmask) for each block of lanes; bit i set = match at baseIndex + i
+template <class Pred, class Emit>
+void forEachMatchMask(const uint32_t* column, const uint32_t* flags, size_t n, const Pred& pred,
+                      uint32_t excludeFlags, Emit&& emit) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i exclude = _mm256_set1_epi32(static_cast<int>(excludeFlags));
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(column + i));
+        __m256i f = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(flags + i));
+        __m256i ok = _mm256_cmpeq_epi32(_mm256_and_si256(f, exclude), zero);
+        __m256i hit = _mm256_and_si256(pred.lanes(v), ok);
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(hit)));
+        if (mask) emit(i, mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint32x4_t exclude = vdupq_n_u32(excludeFlags);
+    const uint32x4_t laneBits = {1, 2, 4, 8};
+    for (; i + 4 <= n; i += 4) {
+        uint32x4_t v = vld1q_u32(column + i);
+        uint32x4_t ok = vceqq_u32(vandq_u32(vld1q_u32(flags + i), exclude), vdupq_n_u32(0));
+        uint32_t mask = vaddvq_u32(vandq_u32(vandq_u32(pred.lanes(v), ok), laneBits));
+        if (mask) emit(i, mask);
+    }
+#endif
+    for (; i < n; ++i)
+        if (pred.scalar(column[i]) && (flags[i] & excludeFlags) == 0) emit(i, 1u);
+}
+
+template <class Pred>
+size_t count(span<const uint32_t> column, span<const uint32_t> flags, const Pred& pred, uint32_t excludeFlags) {
+    size_t total = 0;
+    forEachMatchMask(column.data(), flags.data(), column.size(), pred, excludeFlags,
+                     [&](size_t, uint32_t mask) { total += static_cast<size_t>(__builtin_popcount(mask)); });
+    return total;
+}
+
+// Appends matching indices in ascending order
+template <class Pred>
+void collect(span<const uint32_t> column, span<const uint32_t> flags, const Pred& pred, uint32_t excludeFlags,
+             vector<size_t>& out) {
+    forEachMatchMask(column.data(), flags.data(), column.size(), pred, excludeFlags, [&](size_t base, uint32_t mask) {
+        for (; mask; mask &= mask - 1) out.push_back(base + static_cast<size_t>(__builtin_ctz(mask)));
+    });
+}
+}  // namespace scan
+
+// SongColumns: struct-of-arrays copy of a playlist's per-slot attributes, kept
+// alongside the Playlist for scans. Rebuild after the playlist changes.
+// Duration and flags are annotations the owner sets; REMOVED marks tombstones.
+class SongColumns {
     const Playlist* playlist = nullptr;
-    PlayStrategy* strategy = nullptr;
-    IAudioOutputDevice* device = nullptr;
+    vector<uint32_t> artistCol;     // artist text id per slot
+    vector<uint32_t> titleCol;      // title text id per slot
+    vector<uint32_t> durationCol;   // seconds
+    vector<uint32_t> flagsCol;
 public:
-    void loadPlaylist(const Playlist& pl) { playlist = &pl; }
-    void setStrategy(PlayStrategy* ps) { strategy = ps; strategy->reset(); }
-    void setDevice(IAudioOutputDevice* dev) { device = dev; }
-    void playNext() {
-        if (!playlist || !strategy || !device) throw runtime_error("AudioEngine not configured");
-        const Song& s = strategy->getNextSong(*playlist);
-        device->playSound(s);
+    static constexpr uint32_t REMOVED = 1u << 0;
+    static constexpr uint32_t EXPLICIT = 1u << 1;
+
+    explicit SongColumns(const Playlist& pl) { rebuild(pl); }
+    // Durations and flags are kept by slot position (set them again after
+    // Playlist::compact() shifts slots); REMOVED is refreshed from the playlist
+    void rebuild(const Playlist& pl) {
+        playlist = &pl;
+        size_t n = pl.slotCount();
+        artistCol.resize(n);
+        titleCol.resize(n);
+        durationCol.resize(n, 0);
+        flagsCol.resize(n, 0);
+        const SongCatalog& catalog = pl.getCatalog();
+        span<const SongId> ids = pl.getSongs();
+        for (size_t i = 0; i < n; ++i) {
+            bool live = ids[i] != INVALID_SONG_ID;
+            artistCol[i] = live ? catalog.artistIdOf(ids[i]) : INVALID_SONG_ID;
+            titleCol[i] = live ? catalog.titleIdOf(ids[i]) : INVALID_SONG_ID;
+            flagsCol[i] = live ? (flagsCol[i] & ~REMOVED) : (flagsCol[i] | REMOVED);
+        }
     }
-    void playMultiple(size_t count) {
-        for (size_t i = 0; i < count; ++i) playNext();
+    size_t size() const { return artistCol.size(); }
+    span<const uint32_t> artists() const { return artistCol; }
+    span<const uint32_t> titles() const { return titleCol; }
+    span<const uint32_t> durations() const { return durationCol; }
+    span<const uint32_t> flags() const { return flagsCol; }
+    void setDuration(size_t slot, uint32_t seconds) { durationCol.at(slot) = seconds; }
+    void setFlags(size_t slot, uint32_t f) { flagsCol.at(slot) = (flagsCol.at(slot) & REMOVED) | (f & ~REMOVED); }
+
+    size_t countByArtist(string_view artist) const {
+        optional<uint32_t> id = playlist->getCatalog().findText(artist);
+        return id ? scan::count(artistCol, flagsCol, scan::EqualTo{*id}, REMOVED) : 0;
+    }
+    // Slot indices ready for CustomQueueStrategy::setQueue
+    vector<size_t> slotsByArtist(string_view artist) const {
+        vector<size_t> out;
+        if (optional<uint32_t> id = playlist->getCatalog().findText(artist))
+            scan::collect(artistCol, flagsCol, scan::EqualTo{*id}, REMOVED, out);
+        return out;
+    }
+    vector<size_t> slotsByDuration(uint32_t minSeconds, uint32_t maxSeconds, uint32_t excludeFlags = 0) const {
+        vector<size_t> out;
+        scan::collect(durationCol, flagsCol, scan::InRange{minSeconds, maxSeconds}, excludeFlags | REMOVED, out);
+        return out;
     }
 };
 
-// Facade
-class MusicPlayerFacade {
-    PlaylistManager playlistManager;
-    DeviceManager deviceManager;
-    unique_ptr<PlayStrategy> strategyPtr;
-    AudioEngine engine;
-public:
-    void addSongToPlaylist(const Song& song) {
-        playlistManager.addSong(song);
+// Search over catalog titles and artists. Words are kept in sorted term
+// dictionaries (prefix lookups are a binary search plus a forward walk), and a
+// trigram inverted index serves substring and fuzzy matches. Postings use a
+// compact CSR layout. Rebuild after the catalog grows.
+struct SearchHit {
+    SongId id;
+    double score;
+};
+
+class SearchIndex {
+    // terms[i] has postings ids[offsets[i], offsets[i + 1]), sorted by SongId
+    template <class Key>
+    struct Postings {
+        vector<Key> keys;
+        vector<uint32_t> offsets;
+        vector<SongId> ids;
+        void build(vector<pair<Key, SongId>>& pairs) {
+            sort(pairs.begin(), pairs.end());
+            pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+            keys.clear(); offsets.clear(); ids.clear();
+            ids.reserve(pairs.size());
+            for (const auto& [key, id] : pairs) {
+                if (keys.empty() || keys.back() != key) {
+                    keys.push_back(key);
+                    offsets.push_back(static_cast<uint32_t>(ids.size()));
+                }
+                ids.push_back(id);
+            }
+            offsets.push_back(static_cast<uint32_t>(ids.size()));
+        }
+        span<const SongId> at(size_t i) const { return span<const SongId>(ids).subspan(offsets[i], offsets[i + 1] - offsets[i]); }
+    };
+
+    const SongCatalog* catalog;
+    Postings<string> titleWords, artistWords;
+    Postings<uint32_t> grams;
+    vector<uint16_t> gramCounts;   // distinct trigrams per song, for fuzzy scoring
+    size_t songCount = 0;
+
+    static string normalize(string_view text) {
+        string out;
+        out.reserve(text.size());
+        for (char c : text) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (isalnum(u) || u >= 0x80) out += static_cast<char>(tolower(u));
+            else if (!out.empty() && out.back() != ' ') out += ' ';
+        }
+        if (!out.empty() && out.back() == ' ') out.pop_back();
+        return out;
     }
-    void removeSongFromPlaylist(size_t index) {
-        playlistManager.removeSong(index);
+    static vector<string_view> words(string_view normalized) {
+        vector<string_view> out;
+        for (size_t pos = 0; pos < normalized.size();) {
+            size_t end = normalized.find(' ', pos);
+            if (end == string_view::npos) end = normalized.size();
+            out.push_back(normalized.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        return out;
     }
-    void configure(DeviceType dt, PlayStrategyType pst) {
-        deviceManager.selectDevice(dt);
-        strategyPtr = StrategyManager::createStrategy(pst);
-        if (!strategyPtr) throw runtime_error("Invalid strategy type");
-        engine.setDevice(deviceManager.getDevice());
-        engine.setStrategy(strategyPtr.get());
-        engine.loadPlaylist(playlistManager.getPlaylist());
+    static uint32_t gramKey(string_view t, size_t i) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(t[i])) << 16)
+             | (static_cast<uint32_t>(static_cast<unsigned char>(t[i + 1])) << 8)
+             | static_cast<uint32_t>(static_cast<unsigned char>(t[i + 2]));
     }
-    void configureCustom(DeviceType dt, const vector<size_t>& customQueue) {
-        deviceManager.selectDevice(dt);
-        strategyPtr = StrategyManager::createStrategy(PlayStrategyType::CUSTOM_QUEUE);
-        if (!strategyPtr) throw runtime_error("Invalid strategy type");
-        auto cqs = dynamic_cast<CustomQueueStrategy*>(strategyPtr.get());
-        if (!cqs) throw runtime_error("Failed to cast to CustomQueueStrategy");
-        cqs->setQueue(customQueue);
-        engine.setDevice(deviceManager.getDevice());
-        engine.setStrategy(strategyPtr.get());
-        engine.loadPlaylist(playlistManager.getPlaylist());
+    // Padded so word starts and ends form their own trigrams
+    static vector<uint32_t> gramsOf(string_view normalized) {
+        string padded = " " + string(normalized) + " ";
+        vector<uint32_t> out;
+        for (size_t i = 0; i + 3 <= padded.size(); ++i) out.push_back(gramKey(padded, i));
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+        return out;
     }
-    void playNext() { engine.playNext(); }
-    void playMultiple(size_t count) { engine.playMultiple(count); }
-    const Playlist& getPlaylist() const {
-        return playlistManager.getPlaylist();
+    string haystack(SongId id) const {
+        Song s = catalog->get(id);
+        return normalize(s.title) + " " + normalize(s.artist);
     }
-};
+    template <class Key>
+    static pair<size_t, size_t> prefixRange(const Postings<Key>& p, string_view prefix) {
+        size_t first = static_cast<size_t>(lower_bound(p.keys.begin(), p.keys.end(), prefix,
+                                           [](const string& k, string_view q) { return string_view(k) < q; }) - p.keys.begin());
+        size_t last = first;
+        while (last < p.keys.size() && string_view(p.keys[last]).substr(0, prefix.size()) == prefix) ++last;
+        return {first, last};
+    }
+    static vector<SearchHit> topK(vector<SearchHit> hits, size_t k) {
+        auto better = [](const SearchHit& a, const SearchHit& b) { return a.score != b.score ? a.score > b.score : a.id < b.id; };
+        size_t keep = min(k, hits.size());
+        partial_sort(hits.begin(), hits.begin() + static_cast<ptrdiff_t>(keep), hits.end(), better);
+        hits.resize(keep);
+        return hits;
+    }
+    static vector<SearchHit> topK(const unordered_map<SongId, double>& scores, size_t k) {
+        vector<SearchHit> hits;
+        hits.reserve(scores.size());
+        for (const auto& [id, score] : scores) hits.push_back({id, score});
+        return topK(move(hits), k);
+    }
+    span<const SongId> gramPostings(uint32_t key) const {
+        auto it = lower_bound(grams.keys.begin(), grams.keys.end(), key);
+        if (it == grams.keys.end() || *it != key) return {};
+        return grams.at(static_cast<size_t>(it - grams.keys.begin()));
+    }
+public:
+    explicit SearchIndex(const SongCatalog& c) : catalog(&c) { rebuild(); }
 
-// main
-int main() {
-    MusicPlayerFacade player;
+    void rebuild() {
+        vector<pair<string, SongId>> titlePairs, artistPairs;
+        vector<pair<uint32_t, SongId>> gramPairs;
+        songCount = catalog->size();
+        gramCounts.assign(songCount, 0);
+        for (SongId id = 0; id < catalog->size(); ++id) {
+            Song s = catalog->get(id);
+            string title = normalize(s.title), artist = normalize(s.artist);
+            for (string_view w : words(title)) titlePairs.emplace_back(string(w), id);
+            for (string_view w : words(artist)) artistPairs.emplace_back(string(w), id);
+            vector<uint32_t> g = gramsOf(title + " " + artist);
+            gramCounts[id] = static_cast<uint16_t>(min<size_t>(g.size(), numeric_limits<uint16_t>::max()));
+            for (uint32_t key : g) gramPairs.emplace_back(key, id);
+        }
+        titleWords.build(titlePairs);
+        artistWords.build(artistPairs);
+        grams.build(gramPairs);
+    }
+    size_t indexedSongs() const { return songCount; }
 
-    // Add songs
-    player.addSongToPlaylist(Song("Lose Yourself", "Eminem"));
-    player.addSongToPlaylist(Song("Bohemian Rhapsody", "Queen"));
-    player.addSongToPlaylist(Song("Blinding Lights", "The Weeknd"));
-    player.addSongToPlaylist(Song("Imagine", "John Lennon"));
+    // Every query word must prefix some title or artist word. Title matches
+    // outrank artist matches, and whole-word matches outrank partial ones.
+    vector<SearchHit> prefix(string_view query, size_t k) const {
+        string q = normalize(query);
+        vector<string_view> qwords = words(q);
+        if (qwords.empty()) return {};
+        vector<SearchHit> acc;
+        for (size_t w = 0; w < qwords.size(); ++w) {
+            // Best score per song for this word, sorted by id
+            vector<SearchHit> matches;
+            size_t lists = 0;
+            auto add = [&](const Postings<string>& p, double weight) {
+                auto [first, last] = prefixRange(p, qwords[w]);
+                for (size_t t = first; t < last; ++t, ++lists) {
+                    double score = weight * (p.keys[t].size() == qwords[w].size() ? 1.0 : 0.5);
+                    for (SongId id : p.at(t)) matches.push_back({id, score});
+                }
+            };
+            add(titleWords, 2.0);
+            add(artistWords, 1.0);
+            if (lists > 1) {
+                sort(matches.begin(), matches.end(), [](const SearchHit& a, const SearchHit& b) {
+                    return a.id != b.id ? a.id < b.id : a.score > b.score;
+                });
+                matches.erase(unique(matches.begin(), matches.end(),
+                                     [](const SearchHit& a, const SearchHit& b) { return a.id == b.id; }), matches.end());
+            }
+            if (w == 0) { acc = move(matches); continue; }
+            size_t out = 0;
+            for (size_t i = 0, j = 0; i < acc.size() && j < matches.size();) {
+                if (acc[i].id < matches[j].id) ++i;
+                else if (matches[j].id < acc[i].id) ++j;
+                else { acc[out++] = {acc[i].id, acc[i].score + matches[j].score}; ++i; ++j; }
+            }
+            acc.resize(out);
+        }
+        return topK(move(acc), k);
+    }
 
-    // 1) Sequential on HEADPHONES
-    player.configure(DeviceType::HEADPHONES, PlayStrategyType::SEQUENTIAL);
-    player.playMultiple(4);
+    // Songs whose "title artist" text contains the query; candidates come from
+    // intersecting trigram postings (rarest first) and are then verified
+    vector<SearchHit> substring(string_view query, size_t k) const {
+        string q = normalize(query);
+        if (q.size() < 3) return prefix(query, k);
+        vector<span<const SongId>> lists;
+        for (size_t i = 0; i + 3 <= q.size(); ++i) {
+            span<const SongId> postings = gramPostings(gramKey(q, i));
+            if (postings.empty()) return {};
+            lists.push_back(postings);
+        }
+        sort(lists.begin(), lists.end(), [](auto a, auto b) { return a.size() < b.size(); });
+        vector<SongId> candidates(lists[0].begin(), lists[0].end()), next;
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i) {
+            next.clear();
+            set_intersection(candidates.begin(), candidates.end(), lists[i].begin(), lists[i].end(), back_inserter(next));
+            candidates.swap(next);
+        }
+        vector<SearchHit> hits;
+        for (SongId id : candidates) {
+            string text = haystack(id);
+            size_t at = text.find(q);
+            if (at == string::npos) continue;
+            hits.push_back({id, 1.0 + static_cast<double>(q.size()) / static_cast<double>(text.size()) + (at == 0 ? 0.5 : 0.0)});
+        }
+        return topK(move(hits), k);
+    }
 
-    // 2) Random on BLUETOOTH
-    player.configure(DeviceType::BLUETOOTH, PlayStrategyType::RANDOM);
-    player.playMultiple(4);
+    // Trigram overlap (Dice coefficient); tolerates typos and transpositions.
+    // Shared trigrams are counted in a per-thread dense scratch array, and only
+    // the touched entries are reset afterwards.
+    vector<SearchHit> fuzzy(string_view query, size_t k, double minScore = 0.3) const {
+        string q = normalize(query);
+        if (q.empty()) return {};
+        vector<uint32_t> qg = gramsOf(q);
+        static thread_local vector<uint16_t> shared;
+        static thread_local vector<SongId> touched;
+        if (shared.size() < songCount) shared.resize(songCount);
+        touched.clear();
+        for (uint32_t key : qg)
+            for (SongId id : gramPostings(key))
+                if (shared[id]++ == 0) touched.push_back(id);
+        vector<SearchHit> hits;
+        for (SongId id : touched) {
+            double dice = 2.0 * shared[id] / static_cast<double>(qg.size() + gramCounts[id]);
+            if (dice >= minScore) hits.push_back({id, dice});
+            shared[id] = 0;
+        }
+        return topK(move(hits), k);
+    }
 
-    // 3) Custom queue on WIRED
-    vector<size_t> order = {1, 0, 3, 2};
-    player.configureCustom(DeviceType::WIRED, order);
-    player.playMultiple(4);
+    // Prefix matches first, then substring, then fuzzy, until k hits
+    vector<SearchHit> search(string_view query, size_t k) const {
+        unordered_map<SongId, double> merged;
+        auto take = [&](vector<SearchHit> hits, double boost) {
+            for (const SearchHit& h : hits) merged.try_emplace(h.id, h.score + boost);
+        };
+        take(prefix(query, k), 4.0);
+        if (merged.size() < k) take(substring(query, k), 2.0);
+        if (merged.size() < k) take(fuzzy(query, k), 0.0);
+        return topK(merged, k);
+    }
+
+    // Playlist slots holding the hit songs, in hit order, for CustomQueueStrategy::setQueue
+    static vector<size_t> toQueue(const Playlist& playlist, span<const SearchHit> hits) {
+        unordered_map<SongId, vector<size_t>> slotsById;
+        for (const SearchHit& h : hits) slotsById[h.id];
+        span<const SongId> ids = playlist.getSongs();
+        for (size_t i = 0; i < ids.size(); ++i) {
+            auto it = slotsById.find(ids[i]);
+            if (it != slotsById.end()) it->second.push_back(i);
+        }
+        vector<size_t> queue;
+        for (const SearchHit& h : hits)
+            for (size_t slot : slotsById[h.id]) queue.push_back(slot);
+        return queue;
+    }
+};
+
+// Enums
+enum class DeviceType { BLUETOOTH, WIRED, HEADPHONES };
+enum class PlayStrategyType { SEQUENTIAL, RANDOM, CUSTOM_QUEUE, SHUFFLE, SMART_SHUFFLE };
+
+// External device APIs (simulated). Output is newline-terminated but not
+// flushed per call; the stream flushes when its buffer fills or at exit.
+class BluetoothSpeakerAPI {
+public:
+    void initialize() { /* simulate init */ }
+    void play(string_view data) {
+        cout << "[BluetoothSpeakerAPI] Playing data: " << data << '\n';
+    }
+};
+class WiredSpeakerAPI {
+public:
+    void initialize() { /* simulate init */ }
+    void play(string_view data) {
+        cout << "[WiredSpeakerAPI] Playing data: " << data << '\n';
+    }
+};
+class HeadphonesAPI {
+public:
+    void initialize() { /* simulate init */ }
+    void play(string_view data) {
+        cout << "[HeadphonesAPI] Playing data: " << data << '\n';
+    }
+};
+
+// PooledObject: strategies and devices are allocated from a pmr pool instead of
+// the global heap, so reconfiguration churn recycles fixed-size blocks. Each
+// allocation records its resource, so setResource() only affects later objects.
+class PooledObject {
+    struct alignas(max_align_t) Header { pmr::memory_resource* resource; };
+    // The header sits just before the object; an over-aligned type gets a whole
+    // alignment unit in front of it so the object itself stays aligned
+    static size_t prefixSize(size_t align) { return max(sizeof(Header), align); }
+    // Pool resources pick a block size from the byte count, so keep it a multiple
+    // of the alignment to get aligned blocks
+    static size_t blockSize(size_t n, size_t align) {
+        return (n + prefixSize(align) + align - 1) & ~(align - 1);
+    }
+    static pmr::memory_resource* defaultResource() {
+        static pmr::synchronized_pool_resource pool;
+        return &pool;
+    }
+    static inline atomic<pmr::memory_resource*> resource{nullptr};
+
+    static void* allocate(size_t n, size_t align) {
+        pmr::memory_resource* r = getResource();
+        char* object = static_cast<char*>(r->allocate(blockSize(n, align), align)) + prefixSize(align);
+        ::new (object - sizeof(Header)) Header{r};
+        return object;
+    }
+    static void deallocate(void* p, size_t n, size_t align) {
+        Header* h = reinterpret_cast<Header*>(static_cast<char*>(p) - sizeof(Header));
+        h->resource->deallocate(static_cast<char*>(p) - prefixSize(align), blockSize(n, align), align);
+    }
+public:
+    static pmr::memory_resource* getResource() {
+        pmr::memory_resource* r = resource.load(memory_order_acquire);
+        return r ? r : defaultResource();
+    }
+    // The resource must be thread-safe if objects are created on several threads
+    static void setResource(pmr::memory_resource* r) { resource.store(r, memory_order_release); }
+    static void* operator new(size_t n) { return allocate(n, alignof(max_align_t)); }
+    // Types with alignas above max_align_t (e.g. AsyncOutputDevice's padded ring)
+    static void* operator new(size_t n, align_val_t al) {
+        return allocate(n, max(static_cast<size_t>(al), alignof(max_align_t)));
+    }
+    // Sized delete: with a virtual destructor n is the size of the dynamic type
+    static void operator delete(void* p, size_t n) { deallocate(p, n, alignof(max_align_t)); }
+    static void operator delete(void* p, size_t n, align_val_t al) {
+        deallocate(p, n, max(static_cast<size_t>(al), alignof(max_align_t)));
+    }
+protected:
+    ~PooledObject() = default;
+};
+
+// IAudioOutputDevice interface
+class IAudioOutputDevice : public PooledObject {
+public:
+    virtual void playSound(const Song& song) = 0;
+    // Default forwards one by one; adapters may override to hand the batch over at once
+    virtual void playBatch(span<const Song> songs) {
+        for (const Song& s : songs) playSound(s);
+    }
+    // Hint that song will play soon, so buffers or connections can be warmed
+    // off the critical path; the default does nothing
+    virtual void prepare(const Song&) {}
+    // Plays song from an already formatted "title by artist" body shared by
+    // several devices (see DeviceGroup); the default formats it again
+    virtual void playFormatted(const Song& song, string_view) { playSound(song); }
+    virtual ~IAudioOutputDevice() = default;
+};
+
+// Adapters format into a per-device buffer that keeps its capacity, so a
+// play event allocates nothing once the buffer has grown to the longest payload.
+// The buffer itself comes from the object pool.
+inline void formatPayload(pmr::string& buffer, string_view tag, const Song& song) {
+    buffer.assign(tag).append(song.title).append(" by ").append(song.artist);
+}
+// Grows the buffer ahead of time so formatting the prepared song never reallocates
+inline void reservePayload(pmr::string& buffer, string_view tag, const Song& song) {
+    buffer.reserve(tag.size() + song.title.size() + 4 + song.artist.size());
+}
+
+class BluetoothSpeakerAdapter final : public IAudioOutputDevice {
+    BluetoothSpeakerAPI api;
+    pmr::string buffer{PooledObject::getResource()};
+public:
+    BluetoothSpeakerAdapter() { api.initialize(); }
+    void playSound(const Song& song) override {
+        formatPayload(buffer, "Bluetooth play: ", song);
+        api.play(buffer);
+    }
+    void prepare(const Song& song) override { reservePayload(buffer, "Bluetooth play: ", song); }
+    void playFormatted(const Song&, string_view body) override {
+        buffer.assign("Bluetooth play: ").append(body);
+        api.play(buffer);
+    }
+};
+
+class WiredSpeakerAdapter final : public IAudioOutputDevice {
+    WiredSpeakerAPI api;
+    pmr::string buffer{PooledObject::getResource()};
+public:
+    WiredSpeakerAdapter() { api.initialize(); }
+    void playSound(const Song& song) override {
+        formatPayload(buffer, "Wired play: ", song);
+        api.play(buffer);
+    }
+    void prepare(const Song& song) override { reservePayload(buffer, "Wired play: ", song); }
+    void playFormatted(const Song&, string_view body) override {
+        buffer.assign("Wired play: ").append(body);
+        api.play(buffer);
+    }
+};
+
+class HeadphonesAdapter final : public IAudioOutputDevice {
+    HeadphonesAPI api;
+    pmr::string buffer{PooledObject::getResource()};
+public:
+    HeadphonesAdapter() { api.initialize(); }
+    void playSound(const Song& song) override {
+        formatPayload(buffer, "Headphones play: ", song);
+        api.play(buffer);
+    }
+    void prepare(const Song& song) override { reservePayload(buffer, "Headphones play: ", song); }
+    void playFormatted(const Song&, string_view body) override {
+        buffer.assign("Headphones play: ").append(body);
+        api.play(buffer);
+    }
+};
+
+// NullOutputDevice: discards output; used by benchmarks and load tests
+class NullOutputDevice final : public IAudioOutputDevice {
+    uint64_t played = 0;
+public:
+    void playSound(const Song&) override { ++played; }
+    void playBatch(span<const Song> songs) override { played += songs.size(); }
+    uint64_t getPlayed() const { return played; }
+};
+
+// PCM pipeline. Songs are rendered to planar float blocks that pass through
+// gain, crossfade and sample-rate conversion on the way to a PcmSink. Every
+// buffer is allocated up front, so rendering a song allocates nothing.
+struct alignas(32) AudioBlock {
+    static constexpr size_t FRAMES = 256;
+    static constexpr size_t CHANNELS = 2;
+    float samples[CHANNELS][FRAMES];
+    size_t frames = 0;
+    uint32_t sampleRate = 0;
+};
+
+// Source material is decoded at CD rate; each device type is driven at its own rate
+constexpr uint32_t SOURCE_SAMPLE_RATE = 44'100;
+constexpr uint32_t sampleRateFor(DeviceType type) {
+    switch (type) {
+        case DeviceType::BLUETOOTH: return 48'000;
+        case DeviceType::WIRED: return 96'000;
+        default: return SOURCE_SAMPLE_RATE;
+    }
+}
+
+// Sample kernels over one channel, in scalar, AVX2 (8 lanes) and NEON (4 lanes)
+// forms picked at compile time like the scan kernels. Ramps are linear: the
+// value at sample i is from + i * step.
+namespace dsp {
+// x[i] *= from + i * step; step 0 is a constant gain
+inline void applyGain(float* x, size_t n, float from, float step) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 ramp = _mm256_add_ps(_mm256_set1_ps(from),
+                                      _mm256_mul_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+    for (; i + 8 <= n; i += 8) {
+        __m256 g = _mm256_add_ps(ramp, _mm256_set1_ps(static_cast<float>(i) * step));
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), g));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t lanes = {0, 1, 2, 3};
+    const float32x4_t ramp = vmlaq_n_f32(vdupq_n_f32(from), lanes, step);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t g = vaddq_f32(ramp, vdupq_n_f32(static_cast<float>(i) * step));
+        vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), g));
+    }
+#endif
+    for (; i < n; ++i) x[i] *= from + static_cast<float>(i) * step;
+}
+
+// out[i] = from[i] + t * (to[i] - from[i]) with t = t0 + i * step; out may alias either input
+inline void crossfade(float* out, const float* from, const float* to, size_t n, float t0, float step) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 ramp = _mm256_add_ps(_mm256_set1_ps(t0),
+                                      _mm256_mul_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+    for (; i + 8 <= n; i += 8) {
+        __m256 t = _mm256_add_ps(ramp, _mm256_set1_ps(static_cast<float>(i) * step));
+        __m256 a = _mm256_loadu_ps(from + i);
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(to + i), a);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(a, _mm256_mul_ps(t, d)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t lanes = {0, 1, 2, 3};
+    const float32x4_t ramp = vmlaq_n_f32(vdupq_n_f32(t0), lanes, step);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t t = vaddq_f32(ramp, vdupq_n_f32(static_cast<float>(i) * step));
+        float32x4_t a = vld1q_f32(from + i);
+        vst1q_f32(out + i, vmlaq_f32(a, t, vsubq_f32(vld1q_f32(to + i), a)));
+    }
+#endif
+    for (; i < n; ++i) {
+        float t = t0 + static_cast<float>(i) * step;
+        out[i] = from[i] + t * (to[i] - from[i]);
+    }
+}
+
+// Linear interpolation of in[0, inLen) at pos, pos + step, ... while pos + 1 <
+// inLen, writing at most outCap samples. Returns the count written and leaves
+// pos at the next position. NEON has no gather, so it takes the scalar loop.
+inline size_t resampleLinear(const float* in, size_t inLen, double& pos, double step, float* out, size_t outCap) {
+    size_t w = 0;
+    const double last = static_cast<double>(inLen) - 1;
+#if defined(__AVX2__)
+    const __m256 offsets = _mm256_mul_ps(_mm256_set1_ps(static_cast<float>(step)), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+    // The margin keeps float rounding of the lane positions from reaching in[inLen]
+    for (; w + 8 <= outCap && pos + 7 * step + 1e-3 < last; w += 8, pos += 8 * step) {
+        __m256 p = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(pos)), offsets);
+        __m256i idx = _mm256_cvttps_epi32(p);
+        __m256 frac = _mm256_sub_ps(p, _mm256_cvtepi32_ps(idx));
+        __m256 a = _mm256_i32gather_ps(in, idx, 4);
+        __m256 b = _mm256_i32gather_ps(in + 1, idx, 4);
+        _mm256_storeu_ps(out + w, _mm256_add_ps(a, _mm256_mul_ps(frac, _mm256_sub_ps(b, a))));
+    }
+#endif
+    for (; w < outCap && pos < last; ++w, pos += step) {
+        size_t i = static_cast<size_t>(pos);
+        float frac = static_cast<float>(pos - static_cast<double>(i));
+        out[w] = in[i] + frac * (in[i + 1] - in[i]);
+    }
+    return w;
+}
+}  // namespace dsp
+
+// AudioBlockPool: a fixed set of blocks allocated once. acquire() returns
+// nullptr when every block is in use. Owned by one thread, like the pipeline.
+class AudioBlockPool {
+    unique_ptr<AudioBlock[]> blocks;
+    vector<AudioBlock*> freeList;   // never grows past capacity, so release never allocates
+public:
+    explicit AudioBlockPool(size_t capacity) : blocks(make_unique<AudioBlock[]>(capacity)) {
+        freeList.reserve(capacity);
+        for (size_t i = capacity; i-- > 0;) freeList.push_back(&blocks[i]);
+    }
+    AudioBlock* acquire() {
+        if (freeList.empty()) return nullptr;
+        AudioBlock* b = freeList.back();
+        freeList.pop_back();
+        b->frames = 0;
+        return b;
+    }
+    void release(AudioBlock* b) { freeList.push_back(b); }
+    size_t available() const { return freeList.size(); }
+};
+
+// Receives rendered blocks; a block is only valid during the call
+class PcmSink {
+public:
+    virtual void write(const AudioBlock& block) = 0;
+    virtual ~PcmSink() = default;
+};
+
+// Keeps running totals of what it was given
+class MeterSink final : public PcmSink {
+    uint64_t frames = 0;
+    float peak = 0;
+public:
+    void write(const AudioBlock& block) override {
+        frames += block.frames;
+        for (size_t c = 0; c < AudioBlock::CHANNELS; ++c)
+            for (size_t i = 0; i < block.frames; ++i) peak = max(peak, fabs(block.samples[c][i]));
+    }
+    uint64_t getFrames() const { return frames; }
+    float getPeak() const { return peak; }
+};
+
+// ToneSource: stand-in decoder. A song renders as a sine tone whose pitch comes
+// from its id; a rotating phasor avoids calling sin() per sample.
+class ToneSource {
+    float re = 0, im = 0, rotRe = 1, rotIm = 0;
+    size_t left = 0;
+public:
+    void open(const Song& song, size_t frames) {
+        double hz = 220.0 * exp2(static_cast<double>(song.id % 24) / 12.0);
+        double w = 2 * numbers::pi * hz / SOURCE_SAMPLE_RATE;
+        rotRe = static_cast<float>(cos(w));
+        rotIm = static_cast<float>(sin(w));
+        re = 0.5f;
+        im = 0;
+        left = frames;
+    }
+    // Fills up to n frames of b (same signal on every channel) and returns the count
+    size_t read(AudioBlock& b, size_t n) {
+        n = min({n, left, AudioBlock::FRAMES});
+        for (size_t i = 0; i < n; ++i) {
+            b.samples[0][i] = re;
+            float r = re * rotRe - im * rotIm;
+            im = re * rotIm + im * rotRe;
+            re = r;
+        }
+        float norm = 0.5f / sqrt(re * re + im * im);   // stop the amplitude drifting
+        re *= norm;
+        im *= norm;
+        for (size_t c = 1; c < AudioBlock::CHANNELS; ++c) memcpy(b.samples[c], b.samples[0], n * sizeof(float));
+        b.frames = n;
+        b.sampleRate = SOURCE_SAMPLE_RATE;
+        left -= n;
+        return n;
+    }
+};
+
+// AudioPipeline: decode -> gain -> crossfade -> resample -> sink. The last
+// fadeFrames of each song are held back and crossfaded into the start of the
+// next one; finish() plays out whatever is still held. Volume changes ramp over
+// one block so they do not click. Uses three blocks from the pool.
+class AudioPipeline {
+    AudioBlockPool& pool;
+    PcmSink& sink;
+    ToneSource source;
+    AudioBlock* work;
+    AudioBlock* tail;     // held end of the previous song
+    AudioBlock* out;      // resampler output, filled to FRAMES before it is written
+    uint32_t rate;
+    double step;          // source frames per output frame
+    double pos = 1;       // read position in ext; ext[c][0] repeats the previous block's last sample
+    float ext[AudioBlock::CHANNELS][AudioBlock::FRAMES + 1] = {};
+    size_t fadeFrames;
+    float gain = 1;
+    atomic<float> volume{1};
+    uint64_t framesOut = 0;
+
+    void applyVolume(AudioBlock& b) {
+        float target = volume.load(memory_order_relaxed);
+        float stepGain = b.frames ? (target - gain) / static_cast<float>(b.frames) : 0;
+        if (gain == 1 && stepGain == 0) return;
+        for (size_t c = 0; c < AudioBlock::CHANNELS; ++c) dsp::applyGain(b.samples[c], b.frames, gain, stepGain);
+        gain = target;
+    }
+    void emit(AudioBlock& b) {
+        b.sampleRate = rate;
+        framesOut += b.frames;
+        sink.write(b);
+    }
+    // Sends the first n frames of b on at the output rate
+    void output(AudioBlock& b, size_t n) {
+        if (n == 0) return;
+        if (rate == SOURCE_SAMPLE_RATE) {
+            size_t full = b.frames;
+            b.frames = n;
+            emit(b);
+            b.frames = full;
+            return;
+        }
+        for (size_t c = 0; c < AudioBlock::CHANNELS; ++c) {
+            ext[c][0] = ext[c][AudioBlock::FRAMES];
+            memcpy(ext[c] + 1, b.samples[c], n * sizeof(float));
+        }
+        for (;;) {
+            size_t room = AudioBlock::FRAMES - out->frames, written = 0;
+            double next = pos;
+            for (size_t c = 0; c < AudioBlock::CHANNELS; ++c) {
+                next = pos;
+                written = dsp::resampleLinear(ext[c], n + 1, next, step, out->samples[c] + out->frames, room);
+            }
+            pos = next;
+            out->frames += written;
+            if (out->frames < AudioBlock::FRAMES) break;
+            emit(*out);
+            out->frames = 0;
+        }
+        pos -= static_cast<double>(n);
+        for (size_t c = 0; c < AudioBlock::CHANNELS; ++c) ext[c][AudioBlock::FRAMES] = ext[c][n];
+    }
+public:
+    AudioPipeline(AudioBlockPool& blocks, PcmSink& s, uint32_t outputRate, size_t fade = AudioBlock::FRAMES)
+        : pool(blocks), sink(s), rate(outputRate),
+          step(static_cast<double>(SOURCE_SAMPLE_RATE) / outputRate), fadeFrames(fade) {
+        if (outputRate == 0) throw runtime_error("Invalid sample rate");
+        if (fade > AudioBlock::FRAMES) throw runtime_error("Crossfade longer than one block");
+        work = pool.acquire();
+        tail = pool.acquire();
+        out = pool.acquire();
+        if (!work || !tail || !out) throw runtime_error("Audio block pool exhausted");
+    }
+    ~AudioPipeline() {
+        pool.release(out);
+        pool.release(tail);
+        pool.release(work);
+    }
+    AudioPipeline(const AudioPipeline&) = delete;
+    AudioPipeline& operator=(const AudioPipeline&) = delete;
+
+    // Any thread; takes effect from the next block
+    void setVolume(float v) { volume.store(v, memory_order_relaxed); }
+    float getVolume() const { return volume.load(memory_order_relaxed); }
+
+    void render(const Song& song, size_t frames) {
+        if (frames == 0) return;
+        source.open(song, frames);
+        size_t tailLen = min(fadeFrames, frames / 2);
+        size_t body = frames - tailLen;
+        // The overlap is cut short when this song is too short to cover the held tail
+        size_t overlap = min(tail->frames, body);
+        output(*tail, tail->frames - overlap);
+        for (size_t done = 0; done < body;) {
+            size_t n = source.read(*work, done == 0 && overlap ? overlap : body - done);
+            applyVolume(*work);
+            if (done == 0 && overlap) {
+                float stepT = 1.0f / static_cast<float>(overlap + 1);
+                size_t from = tail->frames - overlap;
+                for (size_t c = 0; c < AudioBlock::CHANNELS; ++c)
+                    dsp::crossfade(work->samples[c], tail->samples[c] + from, work->samples[c], n, stepT, stepT);
+            }
+            output(*work, n);
+            done += n;
+        }
+        tail->frames = 0;
+        if (tailLen) {
+            source.read(*tail, tailLen);
+            applyVolume(*tail);
+        }
+    }
+    // Plays out the held tail and any partly filled output block
+    void finish() {
+        output(*tail, tail->frames);
+        tail->frames = 0;
+        if (out->frames) {
+            emit(*out);
+            out->frames = 0;
+        }
+    }
+    uint32_t getSampleRate() const { return rate; }
+    uint64_t getFramesOut() const { return framesOut; }
+};
+
+// PcmOutputDevice: hands each song's metadata to the wrapped adapter, then
+// renders its audio through an AudioPipeline at the device type's sample rate.
+// Without a sink the audio goes to a MeterSink; a given sink must outlive the device.
+class PcmOutputDevice final : public IAudioOutputDevice {
+    unique_ptr<IAudioOutputDevice> inner;
+    MeterSink meter;
+    AudioBlockPool pool{3};
+    AudioPipeline pipeline;
+    size_t songFrames;
+public:
+    // Songs are a tenth of a second long by default, which keeps simulated playback quick
+    static constexpr size_t DEFAULT_SONG_FRAMES = SOURCE_SAMPLE_RATE / 10;
+
+    PcmOutputDevice(unique_ptr<IAudioOutputDevice> dev, DeviceType type, PcmSink* sink = nullptr,
+                    size_t framesPerSong = DEFAULT_SONG_FRAMES)
+        : inner(move(dev)), pipeline(pool, sink ? *sink : meter, sampleRateFor(type)), songFrames(framesPerSong) {
+        if (!inner) throw runtime_error("Failed to create device");
+    }
+    ~PcmOutputDevice() override { pipeline.finish(); }
+    void playSound(const Song& song) override {
+        inner->playSound(song);
+        pipeline.render(song, songFrames);
+    }
+    void playBatch(span<const Song> songs) override {
+        inner->playBatch(songs);
+        for (const Song& s : songs) pipeline.render(s, songFrames);
+    }
+    void prepare(const Song& song) override { inner->prepare(song); }
+    void playFormatted(const Song& song, string_view body) override {
+        inner->playFormatted(song, body);
+        pipeline.render(song, songFrames);
+    }
+    AudioPipeline& getPipeline() { return pipeline; }
+    const MeterSink& getMeter() const { return meter; }
+};
+
+// Chunk cache for a streaming backend: songs are fetched in fixed chunks, and
+// popular chunks stay in memory instead of being fetched on every play.
+using ChunkData = shared_ptr<const vector<uint8_t>>;
+// Fetches one chunk of a song; may block (network) and may throw
+using ChunkLoader = function<ChunkData(SongId song, uint32_t chunk)>;
+
+struct ChunkKey {
+    SongId song;
+    uint32_t chunk;
+    bool operator==(const ChunkKey&) const = default;
+    uint64_t hash() const { return ((uint64_t(song) << 32) | chunk) * 0x9E3779B97F4A7C15ull; }
+};
+struct ChunkKeyHash {
+    size_t operator()(const ChunkKey& k) const { return static_cast<size_t>(k.hash()); }
+};
+
+// ChunkCache: bounded by payload bytes and split into shards, each with its own
+// lock, map and CLOCK ring, so concurrent sessions rarely contend. CLOCK gives
+// every hit a second chance instead of moving it in a list, so a hit only sets
+// a flag. Concurrent misses on one chunk share a single load (single flight).
+// A chunk larger than one shard's budget is returned but not kept.
+class ChunkCache {
+public:
+    struct Stats {
+        atomic<uint64_t> hits{0}, misses{0}, coalesced{0}, evictions{0}, bytes{0}, entries{0};
+    };
+private:
+    struct Entry {
+        ChunkKey key{};
+        ChunkData data;
+        bool referenced = false;
+    };
+    struct alignas(64) Shard {
+        mutex m;
+        unordered_map<ChunkKey, size_t, ChunkKeyHash> index;   // key -> slot in ring
+        vector<Entry> ring;
+        vector<size_t> freeSlots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        unordered_map<ChunkKey, shared_future<ChunkData>, ChunkKeyHash> loading;
+    };
+    unique_ptr<Shard[]> shards;
+    size_t shardCount;
+    size_t shardBudget;
+    ChunkLoader loader;
+    unique_ptr<Stats> stats = make_unique<Stats>();
+    metrics::GaugeRegistration gauges;   // declared last: unregistered before the stats go
+
+    Shard& shardOf(const ChunkKey& k) { return shards[(k.hash() >> 32) % shardCount]; }
+
+    void evictOne(Shard& s) {
+        for (;;) {
+            Entry& e = s.ring[s.hand];
+            size_t slot = s.hand;
+            s.hand = (s.hand + 1) % s.ring.size();
+            if (!e.data) continue;
+            if (e.referenced) { e.referenced = false; continue; }
+            s.bytes -= e.data->size();
+            stats->bytes.fetch_sub(e.data->size(), memory_order_relaxed);
+            stats->entries.fetch_sub(1, memory_order_relaxed);
+            stats->evictions.fetch_add(1, memory_order_relaxed);
+            s.index.erase(e.key);
+            e.data.reset();
+            s.freeSlots.push_back(slot);
+            return;
+        }
+    }
+    void insert(Shard& s, const ChunkKey& k, ChunkData data) {
+        size_t size = data->size();
+        if (size > shardBudget) return;
+        while (s.bytes + size > shardBudget) evictOne(s);
+        size_t slot;
+        if (!s.freeSlots.empty()) {
+            slot = s.freeSlots.back();
+            s.freeSlots.pop_back();
+        } else {
+            slot = s.ring.size();
+            s.ring.emplace_back();
+        }
+        s.ring[slot] = {k, move(data), false};
+        s.index.emplace(k, slot);
+        s.bytes += size;
+        stats->bytes.fetch_add(size, memory_order_relaxed);
+        stats->entries.fetch_add(1, memory_order_relaxed);
+    }
+public:
+    ChunkCache(size_t capacityBytes, ChunkLoader load, size_t shardsWanted = 16)
+        : shards(make_unique<Shard[]>(max<size_t>(1, shardsWanted))), shardCount(max<size_t>(1, shardsWanted)),
+          shardBudget(capacityBytes / shardCount), loader(move(load)) {
+        if (!loader) throw runtime_error("ChunkCache needs a loader");
+    }
+    ChunkCache(const ChunkCache&) = delete;
+    ChunkCache& operator=(const ChunkCache&) = delete;
+
+    ChunkData get(SongId song, uint32_t chunk) {
+        ChunkKey k{song, chunk};
+        Shard& s = shardOf(k);
+        optional<promise<ChunkData>> loaded;   // engaged on a miss only, so hits allocate nothing
+        {
+            unique_lock<mutex> lk(s.m);
+            if (auto it = s.index.find(k); it != s.index.end()) {
+                Entry& e = s.ring[it->second];
+                e.referenced = true;
+                stats->hits.fetch_add(1, memory_order_relaxed);
+                return e.data;
+            }
+            if (auto it = s.loading.find(k); it != s.loading.end()) {
+                shared_future<ChunkData> pending = it->second;
+                lk.unlock();
+                stats->coalesced.fetch_add(1, memory_order_relaxed);
+                return pending.get();   // rethrows the loader's exception
+            }
+            loaded.emplace();
+            s.loading.emplace(k, loaded->get_future().share());
+            stats->misses.fetch_add(1, memory_order_relaxed);
+        }
+        // Load outside the lock; waiters on this key block on the future instead
+        ChunkData data;
+        try {
+            data = loader(song, chunk);
+            if (!data) throw runtime_error("Chunk loader returned no data");
+        } catch (...) {
+            {
+                lock_guard<mutex> lk(s.m);
+                s.loading.erase(k);
+            }
+            loaded->set_exception(current_exception());
+            throw;
+        }
+        {
+            lock_guard<mutex> lk(s.m);
+            insert(s, k, data);
+            s.loading.erase(k);
+        }
+        loaded->set_value(data);
+        return data;
+    }
+    // Publishes hits, misses, coalesced misses, evictions, bytes and entries as
+    // "<prefix>.<stat>" gauges, plus the hit rate in percent, until the cache is destroyed
+    void registerGauges(const string& prefix) {
+        metrics::GaugeRegistration& r = gauges;
+        const Stats* st = stats.get();
+        r.add(prefix + ".hits", [st] { return st->hits.load(memory_order_relaxed); });
+        r.add(prefix + ".misses", [st] { return st->misses.load(memory_order_relaxed); });
+        r.add(prefix + ".coalesced", [st] { return st->coalesced.load(memory_order_relaxed); });
+        r.add(prefix + ".evictions", [st] { return st->evictions.load(memory_order_relaxed); });
+        r.add(prefix + ".bytes", [st] { return st->bytes.load(memory_order_relaxed); });
+        r.add(prefix + ".entries", [st] { return st->entries.load(memory_order_relaxed); });
+        r.add(prefix + ".hit_rate_pct", [st] {
+            uint64_t hits = st->hits.load(memory_order_relaxed) + st->coalesced.load(memory_order_relaxed);
+            uint64_t total = hits + st->misses.load(memory_order_relaxed);
+            return total ? hits * 100 / total : 0;
+        });
+    }
+    const Stats& getStats() const { return *stats; }
+    size_t capacity() const { return shardBudget * shardCount; }
+};
+
+// Stand-in streaming backend: chunks of chunkBytes filled from the key, each
+// fetch taking `latency`
+inline ChunkLoader simulatedBackend(size_t chunkBytes, chrono::microseconds latency = chrono::microseconds(0)) {
+    return [chunkBytes, latency](SongId song, uint32_t chunk) {
+        if (latency.count() > 0) this_thread::sleep_for(latency);
+        auto data = make_shared<vector<uint8_t>>(chunkBytes);
+        uint8_t fill = static_cast<uint8_t>(ChunkKey{song, chunk}.hash() >> 56);
+        std::fill(data->begin(), data->end(), fill);
+        return ChunkData(move(data));
+    };
+}
+
+// CachingOutputDevice: pulls every chunk of a song through the cache before the
+// wrapped adapter plays it; prepare() fetches the first chunk ahead of time.
+// The cache must outlive the device.
+class CachingOutputDevice final : public IAudioOutputDevice {
+    unique_ptr<IAudioOutputDevice> inner;
+    ChunkCache& cache;
+    uint32_t chunksPerSong;
+    uint64_t bytesStreamed = 0;
+
+    void fetch(const Song& song) {
+        for (uint32_t c = 0; c < chunksPerSong; ++c) bytesStreamed += cache.get(song.id, c)->size();
+    }
+public:
+    CachingOutputDevice(unique_ptr<IAudioOutputDevice> dev, ChunkCache& c, uint32_t chunks = 4)
+        : inner(move(dev)), cache(c), chunksPerSong(chunks) {
+        if (!inner) throw runtime_error("Failed to create device");
+    }
+    void playSound(const Song& song) override {
+        fetch(song);
+        inner->playSound(song);
+    }
+    void playBatch(span<const Song> songs) override {
+        for (const Song& s : songs) fetch(s);
+        inner->playBatch(songs);
+    }
+    void prepare(const Song& song) override {
+        if (chunksPerSong > 0) cache.get(song.id, 0);
+        inner->prepare(song);
+    }
+    void playFormatted(const Song& song, string_view body) override {
+        fetch(song);
+        inner->playFormatted(song, body);
+    }
+    uint64_t getBytesStreamed() const { return bytesStreamed; }
+};
+
+// SpscRing: bounded lock-free single-producer/single-consumer queue. Capacity is
+// rounded up to a power of two; each side caches the other's index so the
+// shared cache line is only touched when the cached view says full/empty.
+template <class T>
+class SpscRing {
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};   // next slot to pop (consumer-owned)
+    size_t cachedTail = 0;
+    alignas(64) atomic<size_t> tail{0};   // next slot to push (producer-owned)
+    size_t cachedHead = 0;
+public:
+    explicit SpscRing(size_t capacity) {
+        size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        slots.resize(cap);
+        mask = cap - 1;
+    }
+    bool tryPush(const T& value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - cachedHead == slots.size()) {
+            cachedHead = head.load(memory_order_acquire);
+            if (t - cachedHead == slots.size()) return false;
+        }
+        slots[t & mask] = value;
+        tail.store(t + 1, memory_order_seq_cst);
+        return true;
+    }
+    bool tryPop(T& value) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == cachedTail) {
+            cachedTail = tail.load(memory_order_acquire);
+            if (h == cachedTail) return false;
+        }
+        value = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+    size_t size() const { return tail.load(memory_order_acquire) - head.load(memory_order_acquire); }
+    size_t capacity() const { return slots.size(); }
+};
+
+// DROP (the default) discards the new song so the producer never waits on the
+// device; BLOCK is opt-in and spins (then yields) until the I/O thread frees a slot
+enum class OverflowPolicy { BLOCK, DROP };
+
+struct OutputQueueStats {
+    uint64_t enqueued = 0;
+    uint64_t played = 0;
+    uint64_t dropped = 0;
+    uint64_t stalls = 0;          // pushes that found the ring full (BLOCK policy)
+    uint64_t highWatermark = 0;   // deepest queue seen
+};
+
+// AsyncOutputDevice: decorates a device with an SPSC ring drained by a dedicated
+// I/O thread, so song selection never waits on device latency. One producer
+// (the owning engine/session) per device. Songs are played after playSound
+// returns, so their text must outlive the queue (see Song).
+class AsyncOutputDevice : public IAudioOutputDevice {
+    static constexpr size_t DRAIN_BATCH = 64;
+    // prepare() hints travel through the ring too, so the inner device is only
+    // ever touched from the I/O thread
+    struct QueuedSong { Song song; bool prepareOnly = false; };
+    unique_ptr<IAudioOutputDevice> inner;
+    SpscRing<QueuedSong> ring;
+    OverflowPolicy policy;
+    atomic<uint64_t> enqueued{0}, played{0}, dropped{0}, stalls{0}, highWatermark{0};
+    // The mutex is only taken when the I/O thread is asleep or someone is flushing;
+    // the steady-state push/pop path is lock-free
+    mutex sleepMutex;
+    condition_variable wakeCv, drainedCv;
+    atomic<uint32_t> consumerSleeping{0};
+    atomic<int> flushWaiters{0};
+    atomic<bool> stopping{false};
+    thread io;
+
+    // Both sides read-modify-write consumerSleeping after their own ring access.
+    // If the producer's RMW comes first, the consumer's exchange synchronizes
+    // with it and sees the pushed song; otherwise the producer sees it asleep.
+    // Either way no wakeup is lost.
+    void wakeConsumer() {
+        if (consumerSleeping.fetch_or(0, memory_order_acq_rel)) {
+            lock_guard<mutex> lk(sleepMutex);
+            wakeCv.notify_one();
+        }
+    }
+    void drain() {
+        Song batch[DRAIN_BATCH];
+        for (;;) {
+            size_t n = 0;
+            bool popped = false;
+            QueuedSong item;
+            while (n < DRAIN_BATCH && ring.tryPop(item)) {
+                popped = true;
+                if (item.prepareOnly) inner->prepare(item.song);
+                else batch[n++] = item.song;
+            }
+            if (popped && n == 0) continue;
+            if (n > 0) {
+                inner->playBatch(span<const Song>(batch, n));
+                played.fetch_add(n, memory_order_seq_cst);
+                if (flushWaiters.load(memory_order_seq_cst) > 0) {
+                    lock_guard<mutex> lk(sleepMutex);
+                    drainedCv.notify_all();
+                }
+                continue;
+            }
+            unique_lock<mutex> lk(sleepMutex);
+            consumerSleeping.exchange(1, memory_order_acq_rel);
+            wakeCv.wait(lk, [this] { return ring.size() > 0 || stopping.load(); });
+            consumerSleeping.store(0, memory_order_relaxed);
+            if (ring.size() == 0 && stopping.load()) return;
+        }
+    }
+public:
+    AsyncOutputDevice(unique_ptr<IAudioOutputDevice> dev, size_t capacity = 1024,
+                      OverflowPolicy p = OverflowPolicy::DROP)
+        : inner(move(dev)), ring(capacity), policy(p) {
+        if (!inner) throw runtime_error("Failed to create device");
+        io = thread([this] { drain(); });
+    }
+    // Plays out whatever is still queued before returning
+    ~AsyncOutputDevice() override {
+        {
+            lock_guard<mutex> lk(sleepMutex);
+            stopping.store(true);
+        }
+        wakeCv.notify_one();
+        io.join();
+    }
+    void playSound(const Song& song) override {
+        if (!ring.tryPush({song})) {
+            if (policy == OverflowPolicy::DROP) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            stalls.fetch_add(1, memory_order_relaxed);
+            for (unsigned spins = 0; !ring.tryPush({song}); ++spins) {
+                wakeConsumer();
+                if (spins > 64) this_thread::yield();
+            }
+        }
+        uint64_t depth = ring.size();
+        if (depth > highWatermark.load(memory_order_relaxed)) highWatermark.store(depth, memory_order_relaxed);
+        enqueued.fetch_add(1, memory_order_relaxed);
+        wakeConsumer();
+    }
+    // A hint only: skipped rather than waited on when the ring is full
+    void prepare(const Song& song) override {
+        if (ring.tryPush({song, true})) wakeConsumer();
+    }
+    // Blocks until everything queued so far has reached the inner device
+    void flush() {
+        uint64_t target = enqueued.load(memory_order_relaxed);
+        flushWaiters.fetch_add(1, memory_order_seq_cst);
+        unique_lock<mutex> lk(sleepMutex);
+        drainedCv.wait(lk, [&] { return played.load(memory_order_seq_cst) >= target; });
+        flushWaiters.fetch_sub(1, memory_order_relaxed);
+    }
+    OutputQueueStats getStats() const {
+        OutputQueueStats st;
+        st.enqueued = enqueued.load(memory_order_relaxed);
+        st.played = played.load(memory_order_relaxed);
+        st.dropped = dropped.load(memory_order_relaxed);
+        st.stalls = stalls.load(memory_order_relaxed);
+        st.highWatermark = highWatermark.load(memory_order_relaxed);
+        return st;
+    }
+    size_t queueDepth() const { return ring.size(); }
+};
+
+// DeviceGroup: fans one stream out to several devices (multi-room). The engine
+// selects each song once; the group formats its body once into a refcounted
+// payload shared by every target, and each target plays it from its own
+// dispatch thread. Targets with less output latency are held back by the
+// difference to the slowest one, so all rooms sound together. Add targets
+// before playing; one producer, as with AsyncOutputDevice, and the same
+// song lifetime rule.
+class DeviceGroup : public IAudioOutputDevice {
+    using Clock = chrono::steady_clock;
+    struct Item {
+        Song song;
+        shared_ptr<const string> payload;
+        Clock::time_point due;
+    };
+    struct Target {
+        unique_ptr<IAudioOutputDevice> device;
+        Clock::duration latency;
+        Clock::duration delay{};     // compensation: slowest latency - own latency
+        mutex m;
+        condition_variable cv, drainedCv;
+        deque<Item> queue;
+        uint64_t played = 0;
+        bool busy = false;
+        bool stopping = false;
+        thread worker;
+    };
+    vector<unique_ptr<Target>> targets;
+    Clock::duration maxLatency{};
+
+    // Takes everything queued at once, so a batch costs one lock round trip
+    static void dispatch(Target& t) {
+        deque<Item> work;
+        unique_lock<mutex> lk(t.m);
+        for (;;) {
+            t.cv.wait(lk, [&] { return !t.queue.empty() || t.stopping; });
+            if (t.queue.empty()) return;
+            work.swap(t.queue);
+            t.busy = true;
+            lk.unlock();
+            for (const Item& item : work) {
+                if (item.due > Clock::now()) this_thread::sleep_until(item.due);
+                t.device->playFormatted(item.song, *item.payload);
+            }
+            size_t n = work.size();
+            work.clear();
+            lk.lock();
+            t.busy = false;
+            t.played += n;
+            if (t.queue.empty()) t.drainedCv.notify_all();
+        }
+    }
+    void enqueue(span<const Song> songs, span<const shared_ptr<const string>> payloads) {
+        Clock::time_point now = Clock::now();
+        for (auto& t : targets) {
+            {
+                lock_guard<mutex> lk(t->m);
+                for (size_t i = 0; i < songs.size(); ++i) t->queue.push_back({songs[i], payloads[i], now + t->delay});
+            }
+            t->cv.notify_one();
+        }
+    }
+    static shared_ptr<const string> format(const Song& song) {
+        auto body = make_shared<string>();
+        body->reserve(song.title.size() + 4 + song.artist.size());
+        body->append(song.title).append(" by ").append(song.artist);
+        return body;
+    }
+public:
+    DeviceGroup() = default;
+    DeviceGroup(const DeviceGroup&) = delete;
+    DeviceGroup& operator=(const DeviceGroup&) = delete;
+    ~DeviceGroup() override {
+        for (auto& t : targets) {
+            {
+                lock_guard<mutex> lk(t->m);
+                t->stopping = true;
+            }
+            t->cv.notify_one();
+            t->worker.join();
+        }
+    }
+    // latency: how long the target takes from play call to audible output
+    void addTarget(unique_ptr<IAudioOutputDevice> device, Clock::duration latency = {}) {
+        if (!device) throw runtime_error("Failed to create device");
+        auto t = make_unique<Target>();
+        t->device = move(device);
+        t->latency = latency;
+        maxLatency = max(maxLatency, latency);
+        for (auto& other : targets) other->delay = maxLatency - other->latency;
+        t->delay = maxLatency - latency;
+        Target* raw = t.get();
+        t->worker = thread([raw] { dispatch(*raw); });
+        targets.push_back(move(t));
+    }
+    void playSound(const Song& song) override {
+        shared_ptr<const string> payload = format(song);
+        enqueue(span<const Song>(&song, 1), span<const shared_ptr<const string>>(&payload, 1));
+    }
+    void playBatch(span<const Song> songs) override {
+        constexpr size_t CHUNK = 64;
+        shared_ptr<const string> payloads[CHUNK];
+        for (size_t first = 0; first < songs.size(); first += CHUNK) {
+            span<const Song> part = songs.subspan(first, min(CHUNK, songs.size() - first));
+            for (size_t i = 0; i < part.size(); ++i) payloads[i] = format(part[i]);
+            enqueue(part, span<const shared_ptr<const string>>(payloads, part.size()));
+        }
+    }
+    void prepare(const Song& song) override {
+        for (auto& t : targets) {
+            lock_guard<mutex> lk(t->m);
+            if (t->queue.empty() && !t->busy) t->device->prepare(song);
+        }
+    }
+    // Blocks until every target has played everything queued so far
+    void flush() {
+        for (auto& t : targets) {
+            unique_lock<mutex> lk(t->m);
+            t->drainedCv.wait(lk, [&] { return t->queue.empty() && !t->busy; });
+        }
+    }
+    size_t targetCount() const { return targets.size(); }
+    uint64_t playedBy(size_t target) {
+        Target& t = *targets.at(target);
+        lock_guard<mutex> lk(t.m);
+        return t.played;
+    }
+    Clock::duration compensationFor(size_t target) const { return targets.at(target)->delay; }
+};
+
+// EventLoop: one thread multiplexes output for many devices and sessions over
+// epoll. post() is safe from any thread and wakes the loop through an eventfd;
+// watch() registers a non-blocking fd (e.g. a real device socket) and must be
+// called before run() or from the loop thread.
+class EventLoop {
+    int epollFd = -1;
+    int wakeFd = -1;
+    mutex postMutex;
+    vector<function<void()>> posted;
+    unordered_map<int, function<void(uint32_t)>> watchers;
+    atomic<bool> stopping{false};
+
+    void runPosted() {
+        vector<function<void()>> tasks;
+        {
+            lock_guard<mutex> lk(postMutex);
+            tasks.swap(posted);
+        }
+        for (auto& task : tasks) task();
+    }
+public:
+    EventLoop() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            if (epollFd >= 0) ::close(epollFd);
+            if (wakeFd >= 0) ::close(wakeFd);
+            throw runtime_error("Failed to create event loop");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+    ~EventLoop() { ::close(wakeFd); ::close(epollFd); }
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void post(function<void()> task) {
+        {
+            lock_guard<mutex> lk(postMutex);
+            posted.push_back(move(task));
+        }
+        uint64_t one = 1;
+        ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+    void watch(int fd, uint32_t events, function<void(uint32_t)> handler) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) throw runtime_error("Failed to watch fd");
+        watchers[fd] = move(handler);
+    }
+    void unwatch(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        watchers.erase(fd);
+    }
+    // Runs until stop(); posted tasks are run in the order they were posted
+    void run() {
+        epoll_event events[64];
+        while (!stopping.load(memory_order_acquire)) {
+            int n = epoll_wait(epollFd, events, 64, -1);
+            if (n < 0 && errno != EINTR) throw runtime_error("epoll_wait failed");
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd == wakeFd) {
+                    uint64_t count;
+                    ssize_t ignored = ::read(wakeFd, &count, sizeof(count));
+                    (void)ignored;
+                    runPosted();
+                } else if (auto it = watchers.find(events[i].data.fd); it != watchers.end()) {
+                    it->second(events[i].events);
+                }
+            }
+        }
+        runPosted();
+    }
+    void stop() { post([this] { stopping.store(true, memory_order_release); }); }
+};
+
+// DetachedTask: fire-and-forget coroutine; the frame frees itself when done
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { terminate(); }
+    };
+};
+
+// LoopOutputDevice: runs a device's output on an EventLoop thread instead of the
+// caller's. playSoundAsync completes through a callback or `co_await`; either
+// way the continuation runs on the loop thread. The plain IAudioOutputDevice
+// calls are fire-and-forget. The device and the songs' text (see Song) must
+// outlive queued output.
+class LoopOutputDevice : public IAudioOutputDevice {
+    unique_ptr<IAudioOutputDevice> inner;
+    EventLoop& loop;
+public:
+    LoopOutputDevice(unique_ptr<IAudioOutputDevice> dev, EventLoop& l) : inner(move(dev)), loop(l) {
+        if (!inner) throw runtime_error("Failed to create device");
+    }
+    void playSoundAsync(const Song& song, function<void()> done) {
+        loop.post([this, song, done = move(done)] {
+            inner->playSound(song);
+            if (done) done();
+        });
+    }
+    struct PlayAwaitable {
+        LoopOutputDevice& device;
+        Song song;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) { device.playSoundAsync(song, [h] { h.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+    PlayAwaitable playSoundAsync(const Song& song) { return {*this, song}; }
+
+    void playSound(const Song& song) override { playSoundAsync(song, nullptr); }
+    void playBatch(span<const Song> songs) override {
+        loop.post([this, batch = vector<Song>(songs.begin(), songs.end())] { inner->playBatch(batch); });
+    }
+    void prepare(const Song& song) override { loop.post([this, song] { inner->prepare(song); }); }
+};
+
+// DeviceFactory
+class DeviceFactory {
+public:
+    static unique_ptr<IAudioOutputDevice> create(DeviceType type) {
+        switch (type) {
+            case DeviceType::BLUETOOTH:
+                return make_unique<BluetoothSpeakerAdapter>();
+            case DeviceType::WIRED:
+                return make_unique<WiredSpeakerAdapter>();
+            case DeviceType::HEADPHONES:
+                return make_unique<HeadphonesAdapter>();
+            default:
+                return nullptr;
+        }
+    }
+    // Same device behind an AsyncOutputDevice queue and I/O thread
+    static unique_ptr<IAudioOutputDevice> createAsync(DeviceType type, size_t capacity = 1024,
+                                                      OverflowPolicy policy = OverflowPolicy::DROP) {
+        auto device = create(type);
+        if (!device) return nullptr;
+        return make_unique<AsyncOutputDevice>(move(device), capacity, policy);
+    }
+    // One group playing to every listed device, with no latency compensation
+    static unique_ptr<DeviceGroup> createGroup(span<const DeviceType> types) {
+        auto group = make_unique<DeviceGroup>();
+        for (DeviceType type : types) group->addTarget(create(type));
+        return group;
+    }
+    // Same device with its audio rendered through a PCM pipeline
+    static unique_ptr<PcmOutputDevice> createPcm(DeviceType type, PcmSink* sink = nullptr) {
+        auto device = create(type);
+        if (!device) return nullptr;
+        return make_unique<PcmOutputDevice>(move(device), type, sink);
+    }
+    // Same device with each song's chunks streamed through cache
+    static unique_ptr<CachingOutputDevice> createCached(DeviceType type, ChunkCache& cache, uint32_t chunksPerSong = 4) {
+        auto device = create(type);
+        if (!device) return nullptr;
+        return make_unique<CachingOutputDevice>(move(device), cache, chunksPerSong);
+    }
+    // Same device with its output driven by an EventLoop thread
+    static unique_ptr<LoopOutputDevice> createOnLoop(DeviceType type, EventLoop& loop) {
+        auto device = create(type);
+        if (!device) return nullptr;
+        return make_unique<LoopOutputDevice>(move(device), loop);
+    }
+};
+
+// PlayStrategy interface
+class SequentialPlayStrategy;
+class PlayStrategy : public PooledObject {
+public:
+    virtual Song getNextSong(const Playlist& playlist) = 0;
+    // Writes the next out.size() song ids and returns how many were written.
+    // Same sequence as repeated getNextSong calls, but one dispatch per batch.
+    virtual size_t fillNext(const Playlist& playlist, span<SongId> out) {
+        for (SongId& id : out) id = getNextSong(playlist).id;
+        return out.size();
+    }
+    virtual void reset() = 0;
+    // Lets the engine take its cursor fast path without RTTI; only the
+    // sequential strategy returns itself
+    virtual SequentialPlayStrategy* asSequential() { return nullptr; }
+    virtual ~PlayStrategy() = default;
+};
+
+// Sequential strategy
+class SequentialPlayStrategy final : public PlayStrategy {
+    size_t index = 0;
+public:
+    // Cursor: validated once against a playlist generation, then each next()
+    // is a tombstone check plus an increment and wrap. It shares the strategy's
+    // position, so cursor and getNextSong calls interleave correctly.
+    class Cursor {
+        const Playlist* playlist;
+        uint64_t generation;
+        const SongId* slots;
+        size_t count;
+        size_t* index;
+    public:
+        Cursor(const Playlist& pl, size_t& idx)
+            : playlist(&pl), generation(pl.getGeneration()), slots(pl.getSongs().data()),
+              count(pl.slotCount()), index(&idx) {
+            if (pl.size() == 0) throw runtime_error("Playlist is empty");
+            if (*index >= count) *index = 0;
+        }
+        // False once the playlist has changed; obtain a new cursor then
+        bool current() const { return playlist->getGeneration() == generation; }
+        SongId next() {
+            size_t i = *index;
+            while (slots[i] == INVALID_SONG_ID) { ++i; i = i == count ? 0 : i; }
+            SongId id = slots[i];
+            ++i;
+            *index = i == count ? 0 : i;
+            return id;
+        }
+    };
+    Cursor cursor(const Playlist& playlist) { return Cursor(playlist, index); }
+
+    Song getNextSong(const Playlist& playlist) override {
+        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
+        size_t slots = playlist.slotCount();
+        if (index >= slots) index = 0;
+        while (!playlist.isLive(index)) if (++index == slots) index = 0;
+        Song s = playlist.getSong(index);
+        if (++index == slots) index = 0;
+        return s;
+    }
+    size_t fillNext(const Playlist& playlist, span<SongId> out) override {
+        Cursor c(playlist, index);
+        for (SongId& id : out) id = c.next();
+        return out.size();
+    }
+    void reset() override { index = 0; }
+    SequentialPlayStrategy* asSequential() override { return this; }
+};
+
+// Random number generation
+inline uint64_t splitmix64(uint64_t& x) {
+    uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Distinct on every call, even for strategies created in the same clock tick
+inline uint64_t freshSeed() {
+    static atomic<uint64_t> counter{0};
+    uint64_t x = (static_cast<uint64_t>(random_device{}()) << 32)
+               ^ static_cast<uint64_t>(chrono::steady_clock::now().time_since_epoch().count())
+               ^ counter.fetch_add(1, memory_order_relaxed);
+    return splitmix64(x);
+}
+
+// xoshiro256**: per-instance state, so no hidden globals and no locking
+class Xoshiro256 {
+    uint64_t s[4];
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+public:
+    explicit Xoshiro256(uint64_t seed) {
+        for (uint64_t& w : s) w = splitmix64(seed);
+    }
+    uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+    // Uniform in [0, bound) without modulo bias (Lemire's multiply-shift)
+    uint64_t below(uint64_t bound) {
+        unsigned __int128 m = static_cast<unsigned __int128>(next()) * bound;
+        uint64_t low = static_cast<uint64_t>(m);
+        if (low < bound) {
+            uint64_t threshold = -bound % bound;
+            while (low < threshold) {
+                m = static_cast<unsigned __int128>(next()) * bound;
+                low = static_cast<uint64_t>(m);
+            }
+        }
+        return static_cast<uint64_t>(m >> 64);
+    }
+};
+
+// Random strategy. UNIFORM draws independently (repeats allowed); SHUFFLE runs an
+// incremental Fisher-Yates so no song repeats until the whole playlist has played.
+enum class RandomMode { UNIFORM, SHUFFLE };
+
+class RandomPlayStrategy final : public PlayStrategy {
+    Xoshiro256 rng;
+    RandomMode mode;
+    pmr::vector<size_t> order{PooledObject::getResource()};  // permutation of slots; order[0, remaining) not yet played this round
+    size_t remaining = 0;
+
+    size_t drawSlot(const Playlist& playlist) {
+        size_t slots = playlist.slotCount();
+        if (mode == RandomMode::UNIFORM) {
+            size_t idx;
+            do idx = rng.below(slots); while (!playlist.isLive(idx));
+            return idx;
+        }
+        if (order.size() > slots) { order.clear(); remaining = 0; }
+        // Songs appended mid-round join the unplayed part of the current round
+        while (order.size() < slots) {
+            order.push_back(order.size());
+            swap(order.back(), order[remaining++]);
+        }
+        for (;;) {
+            if (remaining == 0) remaining = order.size();
+            size_t j = rng.below(remaining);
+            swap(order[j], order[--remaining]);
+            if (playlist.isLive(order[remaining])) return order[remaining];
+        }
+    }
+public:
+    explicit RandomPlayStrategy(RandomMode m = RandomMode::UNIFORM, uint64_t seed = freshSeed())
+        : rng(seed), mode(m) {}
+    Song getNextSong(const Playlist& playlist) override {
+        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
+        return playlist.getSong(drawSlot(playlist));
+    }
+    size_t fillNext(const Playlist& playlist, span<SongId> out) override {
+        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
+        span<const SongId> slots = playlist.getSongs();
+        for (SongId& id : out) id = slots[drawSlot(playlist)];
+        return out.size();
+    }
+    // Starts a fresh shuffle round; the generator keeps its state
+    void reset() override { remaining = order.size(); }
+};
+
+// Custom queue strategy. The queue is checked against the playlist once, when
+// it is set with a playlist (or by an explicit validate() at configuration).
+// Playback never re-validates or throws: entries left stale by later removals
+// are skipped (remap() translates them after compaction; in SHIFT mode later
+// entries move onto their neighbours' songs), and once no entry is
+// playable, or a generator runs dry, songs continue in playlist order.
+// A generator queue produces indices on demand, e.g. for endless radio sessions.
+using QueueGenerator = function<optional<size_t>()>;   // nullopt = end of queue
+
+class CustomQueueStrategy final : public PlayStrategy {
+    vector<size_t> queueIndices;
+    size_t pos = 0;
+    size_t fallbackPos = 0;
+    QueueGenerator generator;
+
+    // Next live slot in playlist order; the playlist must not be empty
+    size_t fallbackSlot(const Playlist& playlist) {
+        for (;;) {
+            if (fallbackPos >= playlist.slotCount()) fallbackPos = 0;
+            size_t idx = fallbackPos++;
+            if (playlist.isLive(idx)) return idx;
+        }
+    }
+    size_t nextSlot(const Playlist& playlist) {
+        if (generator) {
+            while (optional<size_t> idx = generator())
+                if (playlist.isLive(*idx)) return *idx;   // out of range or removed: skipped
+            generator = nullptr;
+            return fallbackSlot(playlist);
+        }
+        for (size_t tries = 0; tries < queueIndices.size(); ++tries) {
+            size_t idx = queueIndices[pos];
+            if (++pos == queueIndices.size()) pos = 0;
+            if (playlist.isLive(idx)) return idx;
+        }
+        return fallbackSlot(playlist);
+    }
+public:
+    // Reports a bad queue at configuration rather than mid-playback
+    void validate(const Playlist& playlist) const {
+        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
+        if (!generator) {
+            if (queueIndices.empty()) throw runtime_error("Custom queue is empty");
+            for (size_t idx : queueIndices)
+                if (idx >= playlist.slotCount()) throw runtime_error("Queue index out of range");
+        }
+    }
+    void setQueue(vector<size_t>&& q) {
+        queueIndices = move(q);
+        generator = nullptr;
+        pos = fallbackPos = 0;
+    }
+    void setQueue(span<const size_t> q) { setQueue(vector<size_t>(q.begin(), q.end())); }
+    void setQueue(initializer_list<size_t> q) { setQueue(vector<size_t>(q)); }
+    // Sets and validates in one step; on failure the previous queue is kept
+    void setQueue(vector<size_t>&& q, const Playlist& playlist) {
+        CustomQueueStrategy candidate;
+        candidate.setQueue(move(q));
+        candidate.validate(playlist);
+        setQueue(move(candidate.queueIndices));
+    }
+    void setGenerator(QueueGenerator gen) {
+        queueIndices.clear();
+        generator = move(gen);
+        pos = fallbackPos = 0;
+    }
+    Song getNextSong(const Playlist& playlist) override {
+        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
+        return playlist.getSong(nextSlot(playlist));
+    }
+    // Writes nothing, rather than throwing, for an empty playlist
+    size_t fillNext(const Playlist& playlist, span<SongId> out) override {
+        if (playlist.size() == 0) return 0;
+        span<const SongId> slots = playlist.getSongs();
+        for (SongId& id : out) id = slots[nextSlot(playlist)];
+        return out.size();
+    }
+    // Rewinds a materialized queue; a generator cannot be rewound
+    void reset() override { pos = fallbackPos = 0; }
+    // Translates queue positions after Playlist::compact()
+    void remap(const vector<size_t>& slotMap) {
+        size_t out = 0;
+        for (size_t idx : queueIndices) {
+            if (idx < slotMap.size() && slotMap[idx] != Playlist::REMOVED) queueIndices[out++] = slotMap[idx];
+            else if (idx >= slotMap.size()) queueIndices[out++] = idx;
+        }
+        queueIndices.resize(out);
+        pos = fallbackPos = 0;
+    }
+};
+
+// FenwickTree: prefix sums over integer weights with O(log n) point updates and
+// O(log n) weighted sampling (the slot holding a point in [0, total))
+class FenwickTree {
+    vector<uint64_t> tree{0};   // 1-based
+    uint64_t sum = 0;
+public:
+    void assign(span<const uint64_t> weights) {
+        tree.assign(weights.size() + 1, 0);
+        sum = 0;
+        for (size_t i = 1; i < tree.size(); ++i) {
+            tree[i] += weights[i - 1];
+            sum += weights[i - 1];
+            size_t parent = i + (i & -i);
+            if (parent < tree.size()) tree[parent] += tree[i];
+        }
+    }
+    // delta is modular, so a decrease is passed as a wrapped negative
+    void add(size_t index, uint64_t delta) {
+        sum += delta;
+        for (size_t i = index + 1; i < tree.size(); i += i & -i) tree[i] += delta;
+    }
+    size_t find(uint64_t point) const {
+        size_t pos = 0;
+        for (size_t step = bit_floor(tree.size() - 1); step > 0; step >>= 1) {
+            if (pos + step < tree.size() && tree[pos + step] <= point) {
+                pos += step;
+                point -= tree[pos];
+            }
+        }
+        return pos;
+    }
+    uint64_t total() const { return sum; }
+    size_t size() const { return tree.size() - 1; }
+};
+
+// Smart shuffle: picks slots with probability proportional to a per-song score.
+// Skips halve a song's score and replays double it; setArtistAffinity scales
+// every song by one artist. Scores belong to the SongId, so they survive edits
+// and may be given before the first pick. Recently played songs are damped
+// until they leave the recency window. Each change is an O(log n) Fenwick
+// update per slot holding the song and each pick an O(log n) descent. A
+// tombstoned slot's weight is zeroed by a point update, the first time a draw
+// lands on it; the weights are rebuilt only when the playlist's layout changes
+// (adds, SHIFT removals, compaction).
+class SmartShuffleStrategy final : public PlayStrategy {
+    static constexpr uint64_t BASE_SCORE = 1024, MIN_SCORE = 16, MAX_SCORE = 1024 * 64;
+    static constexpr uint64_t RECENCY_DIVISOR = 16;
+    static constexpr size_t RECENT_WINDOW = 8;
+    static constexpr uint32_t NO_GROUP = numeric_limits<uint32_t>::max();
+    Xoshiro256 rng;
+    FenwickTree weights;
+    unordered_map<SongId, uint64_t> scores;   // only songs with feedback; the rest score BASE_SCORE
+    deque<pair<SongId, uint32_t>> recent;   // (song, its group in the current build)
+    // Built per playlist generation. A group is one distinct live song and the
+    // slots holding it, so a pick or a feedback call needs no hash lookups.
+    vector<uint64_t> weight;        // per slot, as stored in the tree
+    vector<uint32_t> groupOf;       // per slot; NO_GROUP for removed slots
+    vector<SongId> groupSong;       // ascending
+    vector<uint32_t> groupBegin;    // slots of group g are groupSlots[groupBegin[g], groupBegin[g + 1])
+    vector<size_t> groupSlots;
+    vector<uint64_t> groupScore;
+    vector<uint8_t> groupRecent;    // times the song appears in the window
+    const Playlist* builtFor = nullptr;
+    uint64_t builtLayout = 0;
+    size_t builds = 0;
+
+    uint64_t scoreOf(SongId id) const {
+        auto it = scores.find(id);
+        return it == scores.end() ? BASE_SCORE : it->second;
+    }
+    uint32_t groupFor(SongId id) const {
+        auto it = lower_bound(groupSong.begin(), groupSong.end(), id);
+        return it != groupSong.end() && *it == id ? static_cast<uint32_t>(it - groupSong.begin()) : NO_GROUP;
+    }
+    // Pushes the group's current weight to every slot that holds its song
+    void refresh(uint32_t g) {
+        uint64_t w = groupRecent[g] == 0 ? groupScore[g] : max<uint64_t>(groupScore[g] / RECENCY_DIVISOR, 1);
+        for (uint32_t i = groupBegin[g]; i < groupBegin[g + 1]; ++i) {
+            size_t slot = groupSlots[i];
+            if (groupOf[slot] == NO_GROUP) continue;   // removed since the build
+            weights.add(slot, w - weight[slot]);
+            weight[slot] = w;
+        }
+    }
+    void ensureBuilt(const Playlist& playlist) {
+        if (builtFor == &playlist && builtLayout == playlist.getLayoutGeneration()) return;
+        span<const SongId> slots = playlist.getSongs();
+        vector<pair<SongId, size_t>> bySong;
+        bySong.reserve(slots.size());
+        for (size_t i = 0; i < slots.size(); ++i)
+            if (slots[i] != INVALID_SONG_ID) bySong.emplace_back(slots[i], i);
+        sort(bySong.begin(), bySong.end());
+        groupOf.assign(slots.size(), NO_GROUP);
+        groupSong.clear();
+        groupBegin.clear();
+        groupSlots.clear();
+        for (const auto& [id, slot] : bySong) {
+            if (groupSong.empty() || groupSong.back() != id) {
+                groupSong.push_back(id);
+                groupBegin.push_back(static_cast<uint32_t>(groupSlots.size()));
+            }
+            groupOf[slot] = static_cast<uint32_t>(groupSong.size() - 1);
+            groupSlots.push_back(slot);
+        }
+        groupBegin.push_back(static_cast<uint32_t>(groupSlots.size()));
+        groupScore.resize(groupSong.size());
+        for (size_t g = 0; g < groupSong.size(); ++g) groupScore[g] = scoreOf(groupSong[g]);
+        groupRecent.assign(groupSong.size(), 0);
+        for (auto& [id, g] : recent)
+            if ((g = groupFor(id)) != NO_GROUP) ++groupRecent[g];
+        weight.assign(slots.size(), 0);
+        weights.assign(weight);
+        for (uint32_t g = 0; g < groupSong.size(); ++g) refresh(g);
+        builtFor = &playlist;
+        builtLayout = playlist.getLayoutGeneration();
+        ++builds;
+    }
+    // Point update for a slot tombstoned since the build
+    void drop(size_t slot) {
+        weights.add(slot, uint64_t(0) - weight[slot]);
+        weight[slot] = 0;
+        groupOf[slot] = NO_GROUP;
+    }
+    size_t drawSlot(const Playlist& playlist) {
+        if (playlist.size() == 0) throw runtime_error("Playlist is empty");
+        ensureBuilt(playlist);
+        span<const SongId> slots = playlist.getSongs();
+        for (;;) {
+            size_t slot = weights.find(rng.below(weights.total()));
+            if (slots[slot] == INVALID_SONG_ID) { drop(slot); continue; }   // a live slot keeps the total above 0
+            played(groupOf[slot]);
+            return slot;
+        }
+    }
+    void played(uint32_t g) {
+        recent.emplace_back(groupSong[g], g);
+        ++groupRecent[g];
+        refresh(g);
+        if (recent.size() > RECENT_WINDOW) {
+            uint32_t old = recent.front().second;
+            recent.pop_front();
+            if (old != NO_GROUP) {
+                --groupRecent[old];
+                refresh(old);
+            }
+        }
+    }
+    void scale(SongId id, double factor) {
+        double scaled = clamp(static_cast<double>(scoreOf(id)) * factor, double(MIN_SCORE), double(MAX_SCORE));
+        uint64_t score = scores[id] = static_cast<uint64_t>(scaled);
+        if (!builtFor) return;
+        if (uint32_t g = groupFor(id); g != NO_GROUP) {
+            groupScore[g] = score;
+            refresh(g);
+        }
+    }
+public:
+    explicit SmartShuffleStrategy(uint64_t seed = freshSeed()) : rng(seed) {}
+    Song getNextSong(const Playlist& playlist) override { return playlist.getSong(drawSlot(playlist)); }
+    size_t fillNext(const Playlist& playlist, span<SongId> out) override {
+        for (SongId& id : out) id = playlist.getSongs()[drawSlot(playlist)];
+        return out.size();
+    }
+    // Forgets the recency window; scores are listener feedback and are kept
+    void reset() override {
+        deque<pair<SongId, uint32_t>> window = move(recent);
+        recent.clear();
+        for (auto [id, g] : window)
+            if (g != NO_GROUP) {
+                --groupRecent[g];
+                refresh(g);
+            }
+    }
+    void onSkip(SongId id) { scale(id, 0.5); }
+    void onSkip(const Song& song) { onSkip(song.id); }
+    void onReplay(SongId id) { scale(id, 2.0); }
+    void onReplay(const Song& song) { onReplay(song.id); }
+    // O(k log n) for the artist's k distinct songs in the playlist
+    void setArtistAffinity(const Playlist& playlist, string_view artist, double factor) {
+        ensureBuilt(playlist);
+        optional<uint32_t> artistId = playlist.getCatalog().findText(artist);
+        if (!artistId) return;
+        for (SongId id : groupSong)
+            if (playlist.getCatalog().artistIdOf(id) == *artistId) scale(id, factor);
+    }
+    uint64_t getScore(SongId id) const { return scoreOf(id); }
+    size_t rebuildCount() const { return builds; }
+};
+
+// Plays count songs chosen by strategy, awaiting each output; many of these
+// sessions interleave on one loop thread. The references must outlive the
+// session, and done receives the first error (or null) when it ends.
+inline DetachedTask playOnLoop(LoopOutputDevice& device, const Playlist& playlist, PlayStrategy& strategy,
+                               size_t count, function<void(exception_ptr)> done = nullptr) {
+    exception_ptr error;
+    try {
+        for (size_t i = 0; i < count; ++i) co_await device.playSoundAsync(strategy.getNextSong(playlist));
+    } catch (...) {
+        error = current_exception();
+    }
+    if (done) done(error);
+}
+
+// Managers
+class PlaylistManager {
+    SongCatalog catalog;
+    Playlist playlist{catalog};
+public:
+    PlaylistManager() = default;
+    PlaylistManager(const PlaylistManager&) = delete;
+    PlaylistManager& operator=(const PlaylistManager&) = delete;
+    void addSong(const Song& song) { playlist.addSong(catalog.addSong(song)); }
+    void removeSong(size_t index) { playlist.removeSong(index); }
+    void setRemovalMode(RemovalMode mode) { playlist.setRemovalMode(mode); }
+    // Compacts only when tombstones dominate; returns an empty map otherwise
+    vector<size_t> compactIfNeeded() {
+        return playlist.needsCompaction() ? playlist.compact() : vector<size_t>{};
+    }
+    const Playlist& getPlaylist() const { return playlist; }
+    const SongCatalog& getCatalog() const { return catalog; }
+};
+
+// Sharded playlist service. Playlists are partitioned across nodes on a
+// consistent-hash ring, so adding a node moves only ~1/n of them. Nodes are
+// in-process here; PlaylistCluster's apply/fetch/subscribe calls are the
+// boundary a network transport would replace.
+using PlaylistId = uint64_t;
+
+struct PlaylistMutation {
+    enum class Kind { ADD, REMOVE };
+    Kind kind = Kind::ADD;
+    SongId song = INVALID_SONG_ID;   // ADD
+    size_t index = 0;                // REMOVE (slot index)
+};
+
+// One storage node: versioned immutable playlists, one new version per batch
+class PlaylistNode {
+public:
+    struct Stored { PlaylistSnapshot playlist; uint64_t version = 0; };
+private:
+    const SongCatalog& catalog;
+    mutable mutex nodeMutex;
+    unordered_map<PlaylistId, Stored> playlists;
+public:
+    explicit PlaylistNode(const SongCatalog& c) : catalog(c) {}
+    uint64_t apply(PlaylistId id, span<const PlaylistMutation> batch) {
+        lock_guard<mutex> lk(nodeMutex);
+        Stored& st = playlists[id];
+        Playlist next = st.playlist ? Playlist(*st.playlist) : Playlist(catalog);
+        for (const PlaylistMutation& m : batch) {
+            if (m.kind == PlaylistMutation::Kind::ADD) next.addSong(m.song);
+            else next.removeSong(m.index);
+        }
+        st.playlist = make_shared<const Playlist>(move(next));
+        return ++st.version;
+    }
+    // Unknown ids read as an empty playlist at version 0
+    Stored fetch(PlaylistId id) const {
+        lock_guard<mutex> lk(nodeMutex);
+        auto it = playlists.find(id);
+        if (it == playlists.end()) return {make_shared<const Playlist>(catalog), 0};
+        return it->second;
+    }
+    // Removes and returns the playlists for which moves(id) is true
+    vector<pair<PlaylistId, Stored>> extract(const function<bool(PlaylistId)>& moves) {
+        lock_guard<mutex> lk(nodeMutex);
+        vector<pair<PlaylistId, Stored>> out;
+        for (auto it = playlists.begin(); it != playlists.end();) {
+            if (moves(it->first)) { out.emplace_back(it->first, move(it->second)); it = playlists.erase(it); }
+            else ++it;
+        }
+        return out;
+    }
+    void insert(PlaylistId id, Stored st) {
+        lock_guard<mutex> lk(nodeMutex);
+        playlists[id] = move(st);
+    }
+    size_t playlistCount() const {
+        lock_guard<mutex> lk(nodeMutex);
+        return playlists.size();
+    }
+};
+
+// The "remote" side: ring, nodes and invalidation broadcast
+class PlaylistCluster {
+public:
+    using Listener = function<void(PlaylistId, uint64_t)>;
+private:
+    const SongCatalog& catalog;
+    size_t virtualNodes;
+    vector<unique_ptr<PlaylistNode>> nodes;
+    vector<pair<uint64_t, size_t>> ring;      // (point, node), sorted by point
+    mutable shared_mutex topologyMutex;       // exclusive only while adding nodes
+    mutex listenerMutex;
+    unordered_map<size_t, Listener> listeners;
+    size_t nextListener = 0;
+
+    static uint64_t hashOf(uint64_t key) { return splitmix64(key); }
+    void addRingPoints(size_t node) {
+        for (size_t v = 0; v < virtualNodes; ++v) ring.emplace_back(hashOf((uint64_t(node) << 32) | v), node);
+        sort(ring.begin(), ring.end());
+    }
+    size_t ownerOf(PlaylistId id) const {
+        auto it = lower_bound(ring.begin(), ring.end(), pair<uint64_t, size_t>(hashOf(id), 0));
+        return it == ring.end() ? ring.front().second : it->second;
+    }
+public:
+    PlaylistCluster(const SongCatalog& c, size_t nodeCount, size_t vnodes = 64)
+        : catalog(c), virtualNodes(vnodes) {
+        if (nodeCount == 0) throw runtime_error("Cluster needs at least one node");
+        for (size_t i = 0; i < nodeCount; ++i) addNode();
+    }
+    // Adds a node and moves over only the playlists whose ring owner changed
+    size_t addNode() {
+        unique_lock<shared_mutex> lk(topologyMutex);
+        size_t node = nodes.size();
+        nodes.push_back(make_unique<PlaylistNode>(catalog));
+        addRingPoints(node);
+        for (size_t i = 0; i < node; ++i)
+            for (auto& [id, st] : nodes[i]->extract([&](PlaylistId pid) { return ownerOf(pid) == node; }))
+                nodes[node]->insert(id, move(st));
+        return node;
+    }
+    uint64_t apply(PlaylistId id, span<const PlaylistMutation> batch) {
+        uint64_t version;
+        {
+            shared_lock<shared_mutex> lk(topologyMutex);
+            version = nodes[ownerOf(id)]->apply(id, batch);
+        }
+        lock_guard<mutex> lk(listenerMutex);
+        for (auto& [token, listener] : listeners) listener(id, version);
+        return version;
+    }
+    PlaylistNode::Stored fetch(PlaylistId id) const {
+        shared_lock<shared_mutex> lk(topologyMutex);
+        return nodes[ownerOf(id)]->fetch(id);
+    }
+    // Listeners hear about every new version; they run on the applying thread
+    size_t subscribe(Listener listener) {
+        lock_guard<mutex> lk(listenerMutex);
+        listeners.emplace(nextListener, move(listener));
+        return nextListener++;
+    }
+    void unsubscribe(size_t token) {
+        lock_guard<mutex> lk(listenerMutex);
+        listeners.erase(token);
+    }
+    size_t nodeOf(PlaylistId id) const {
+        shared_lock<shared_mutex> lk(topologyMutex);
+        return ownerOf(id);
+    }
+    size_t nodeCount() const {
+        shared_lock<shared_mutex> lk(topologyMutex);
+        return nodes.size();
+    }
+    size_t playlistCount(size_t node) const {
+        shared_lock<shared_mutex> lk(topologyMutex);
+        return nodes.at(node)->playlistCount();
+    }
+};
+
+// Client side: a bounded cache of hot snapshots, dropped when the cluster
+// announces a newer version, and per-playlist mutation batches. Engines play a
+// pinned view (AudioEngine::loadPlaylist(view(id))), so playback never waits on
+// a node; view() flushes that playlist's pending edits first (read-your-writes).
+class ShardedPlaylistService {
+    static constexpr size_t MUTATION_BATCH = 64;
+    struct Cached { PlaylistSnapshot playlist; uint64_t version = 0; uint64_t lastUse = 0; };
+    PlaylistCluster& cluster;
+    size_t cacheCapacity;
+    mutex serviceMutex;
+    unordered_map<PlaylistId, Cached> cache;
+    unordered_map<PlaylistId, vector<PlaylistMutation>> pending;
+    // Misses being fetched outside the lock, and the newest version announced
+    // meanwhile; a fetch older than that is retried rather than cached
+    struct Inflight { size_t fetchers = 0; uint64_t announced = 0; };
+    unordered_map<PlaylistId, Inflight> inflight;
+    uint64_t tick = 0;
+    size_t listenerToken;
+    uint64_t hits = 0, misses = 0;
+
+    void invalidate(PlaylistId id, uint64_t version) {
+        lock_guard<mutex> lk(serviceMutex);
+        auto it = cache.find(id);
+        if (it != cache.end() && it->second.version < version) cache.erase(it);
+        auto f = inflight.find(id);
+        if (f != inflight.end()) f->second.announced = max(f->second.announced, version);
+    }
+    void evictLeastRecent() {
+        auto victim = min_element(cache.begin(), cache.end(),
+                                  [](const auto& a, const auto& b) { return a.second.lastUse < b.second.lastUse; });
+        if (victim != cache.end()) cache.erase(victim);
+    }
+    // Ships a batch outside the lock: the cluster calls back into invalidate()
+    void send(PlaylistId id, vector<PlaylistMutation> batch) {
+        if (!batch.empty()) cluster.apply(id, batch);
+    }
+    void queue(PlaylistId id, PlaylistMutation m) {
+        vector<PlaylistMutation> full;
+        {
+            lock_guard<mutex> lk(serviceMutex);
+            vector<PlaylistMutation>& batch = pending[id];
+            batch.push_back(m);
+            if (batch.size() < MUTATION_BATCH) return;
+            full.swap(batch);
+        }
+        send(id, move(full));
+    }
+public:
+    explicit ShardedPlaylistService(PlaylistCluster& c, size_t capacity = 64)
+        : cluster(c), cacheCapacity(max<size_t>(capacity, 1)) {
+        listenerToken = cluster.subscribe([this](PlaylistId id, uint64_t v) { invalidate(id, v); });
+    }
+    ~ShardedPlaylistService() {
+        flush();
+        cluster.unsubscribe(listenerToken);
+    }
+    ShardedPlaylistService(const ShardedPlaylistService&) = delete;
+    ShardedPlaylistService& operator=(const ShardedPlaylistService&) = delete;
+
+    void addSong(PlaylistId id, SongId song) { queue(id, {PlaylistMutation::Kind::ADD, song, 0}); }
+    void removeSong(PlaylistId id, size_t index) { queue(id, {PlaylistMutation::Kind::REMOVE, INVALID_SONG_ID, index}); }
+    void flush(PlaylistId id) {
+        vector<PlaylistMutation> batch;
+        {
+            lock_guard<mutex> lk(serviceMutex);
+            auto it = pending.find(id);
+            if (it == pending.end()) return;
+            batch.swap(it->second);
+            pending.erase(it);
+        }
+        send(id, move(batch));
+    }
+    void flush() {
+        unordered_map<PlaylistId, vector<PlaylistMutation>> all;
+        {
+            lock_guard<mutex> lk(serviceMutex);
+            all.swap(pending);
+        }
+        for (auto& [id, batch] : all) send(id, move(batch));
+    }
+    // A miss fetches from the cluster without holding the service lock, so it
+    // does not stall other views, edits or invalidations
+    PlaylistSnapshot view(PlaylistId id) {
+        flush(id);
+        unique_lock<mutex> lk(serviceMutex);
+        auto it = cache.find(id);
+        if (it != cache.end()) {
+            ++hits;
+            it->second.lastUse = ++tick;
+            return it->second.playlist;
+        }
+        ++misses;
+        ++inflight[id].fetchers;
+        for (;;) {
+            lk.unlock();
+            PlaylistNode::Stored st = cluster.fetch(id);
+            lk.lock();
+            Inflight& f = inflight[id];
+            if (f.announced > st.version) continue;   // changed while fetching
+            if (--f.fetchers == 0) inflight.erase(id);
+            it = cache.find(id);
+            if (it != cache.end() && it->second.version >= st.version) {   // a racing miss got there first
+                it->second.lastUse = ++tick;
+                return it->second.playlist;
+            }
+            if (it == cache.end() && cache.size() >= cacheCapacity) evictLeastRecent();
+            cache[id] = {st.playlist, st.version, ++tick};
+            return st.playlist;
+        }
+    }
+    uint64_t cacheHits() { lock_guard<mutex> lk(serviceMutex); return hits; }
+    uint64_t cacheMisses() { lock_guard<mutex> lk(serviceMutex); return misses; }
+};
+
+// DeviceManager keeps each adapter it has initialized, keyed by DeviceType, so
+// switching back to a recently used device is a pointer swap rather than a new
+// initialize(). Adapters left idle longer than the idle timeout are released.
+class DeviceManager {
+    using Clock = chrono::steady_clock;
+    static constexpr size_t DEVICE_TYPES = 3;
+    struct PooledDevice {
+        unique_ptr<IAudioOutputDevice> device;
+        Clock::time_point lastUsed;
+    };
+    mutable mutex m;   // selection may race with prewarm or eviction from another thread
+    array<PooledDevice, DEVICE_TYPES> pool;
+    IAudioOutputDevice* current = nullptr;
+    Clock::duration idleTimeout;
+
+    size_t evictLocked(Clock::time_point now) {
+        size_t evicted = 0;
+        for (PooledDevice& pd : pool) {
+            if (!pd.device || pd.device.get() == current || now - pd.lastUsed < idleTimeout) continue;
+            pd.device.reset();
+            ++evicted;
+        }
+        return evicted;
+    }
+
+    PooledDevice& acquire(DeviceType type) {
+        size_t slot = static_cast<size_t>(type);
+        if (slot >= DEVICE_TYPES) throw runtime_error("Failed to create device");
+        PooledDevice& pd = pool[slot];
+        if (!pd.device) {
+            pd.device = DeviceFactory::create(type);
+            if (!pd.device) throw runtime_error("Failed to create device");
+        }
+        pd.lastUsed = Clock::now();
+        return pd;
+    }
+public:
+    explicit DeviceManager(Clock::duration idle = chrono::minutes(5)) : idleTimeout(idle) {}
+    void selectDevice(DeviceType type) {
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> lk(m);
+        for (PooledDevice& pd : pool)
+            if (pd.device.get() == current) pd.lastUsed = now;   // idle from now on
+        current = acquire(type).device.get();
+        evictLocked(now);
+    }
+    // Initializes devices up front, e.g. at startup, so first use is a swap too
+    void prewarm(span<const DeviceType> types) {
+        lock_guard<mutex> lk(m);
+        for (DeviceType type : types) acquire(type);
+    }
+    void prewarm(initializer_list<DeviceType> types) { prewarm(span<const DeviceType>(types.begin(), types.size())); }
+    // Releases adapters idle past the timeout; the current device is never evicted
+    size_t evictIdle(Clock::time_point now = Clock::now()) {
+        lock_guard<mutex> lk(m);
+        return evictLocked(now);
+    }
+    size_t pooledCount() const {
+        lock_guard<mutex> lk(m);
+        return static_cast<size_t>(count_if(pool.begin(), pool.end(), [](const PooledDevice& pd) { return pd.device != nullptr; }));
+    }
+    IAudioOutputDevice* getDevice() const {
+        lock_guard<mutex> lk(m);
+        return current;
+    }
+};
+
+class StrategyManager {
+public:
+    static unique_ptr<PlayStrategy> createStrategy(PlayStrategyType type) {
+        switch (type) {
+            case PlayStrategyType::SEQUENTIAL:
+                return make_unique<SequentialPlayStrategy>();
+            case PlayStrategyType::RANDOM:
+                return make_unique<RandomPlayStrategy>();
+            case PlayStrategyType::CUSTOM_QUEUE:
+                return make_unique<CustomQueueStrategy>();
+            case PlayStrategyType::SHUFFLE:
+                return make_unique<RandomPlayStrategy>(RandomMode::SHUFFLE);
+            case PlayStrategyType::SMART_SHUFFLE:
+                return make_unique<SmartShuffleStrategy>();
+            default:
+                return nullptr;
+        }
+    }
+};
+
+// Play-event log: what the engines actually played. Appends go to a per-thread
+// buffer; full buffers are handed to a writer thread, which group-commits every
+// batch waiting at that moment as one block. The file is append-only: a magic
+// header, then blocks of columns (timestamp, session, song, device), each
+// delta/zigzag varint coded. A torn trailing block is ignored on read.
+struct PlayEvent {
+    uint64_t timestampNs;   // system clock, ns since the epoch
+    uint32_t session;
+    SongId song;
+    DeviceType device;
+};
+
+class PlayEventLog {
+    static constexpr char MAGIC[8] = {'S', 'P', 'O', 'T', 'L', 'O', 'G', '\0'};
+    static constexpr size_t BUFFER_EVENTS = 1024;
+    // The mutex is only contended when flush() collects a partial buffer
+    struct ThreadBuffer { mutex m; vector<PlayEvent> events; };
+
+    uint64_t logId;
+    ofstream out;
+    mutex registryMutex;
+    vector<shared_ptr<ThreadBuffer>> buffers;
+    mutex readyMutex;
+    condition_variable readyCv, committedCv;
+    vector<vector<PlayEvent>> ready;
+    uint64_t submitted = 0, committed = 0, blocks = 0, events = 0;
+    bool stopping = false;
+    thread writer;
+
+    static uint64_t nextLogId() {
+        static atomic<uint64_t> ids{0};
+        return ++ids;
+    }
+    // One buffer per (thread, log); the log owns it, the thread only has a weak
+    // handle, so entries for destroyed logs expire and are pruned on insert
+    ThreadBuffer& local() {
+        static thread_local unordered_map<uint64_t, weak_ptr<ThreadBuffer>> bound;
+        static thread_local pair<uint64_t, ThreadBuffer*> last{0, nullptr};
+        if (last.first == logId) return *last.second;
+        auto it = bound.find(logId);
+        if (it == bound.end()) {
+            erase_if(bound, [](const auto& kv) { return kv.second.expired(); });
+            auto buffer = make_shared<ThreadBuffer>();
+            buffer->events.reserve(BUFFER_EVENTS);
+            {
+                lock_guard<mutex> lk(registryMutex);
+                buffers.push_back(buffer);
+            }
+            it = bound.emplace(logId, buffer).first;
+        }
+        last = {logId, it->second.lock().get()};
+        return *last.second;
+    }
+    void submit(vector<PlayEvent>&& batch) {
+        if (batch.empty()) return;
+        {
+            lock_guard<mutex> lk(readyMutex);
+            ready.push_back(move(batch));
+            ++submitted;
+        }
+        readyCv.notify_one();
+    }
+
+    static void putVarint(vector<uint8_t>& out, uint64_t v) {
+        while (v >= 0x80) { out.push_back(static_cast<uint8_t>(v | 0x80)); v >>= 7; }
+        out.push_back(static_cast<uint8_t>(v));
+    }
+    static bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+        v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t b = *p++;
+            v |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+    static uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+    static int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+    // Block: varint event count, varint payload bytes, then the four columns
+    static void encode(vector<PlayEvent>& evs, vector<uint8_t>& block) {
+        stable_sort(evs.begin(), evs.end(), [](const PlayEvent& a, const PlayEvent& b) { return a.timestampNs < b.timestampNs; });
+        vector<uint8_t> payload;
+        payload.reserve(evs.size() * 6);
+        uint64_t prevTime = 0;
+        for (const PlayEvent& e : evs) { putVarint(payload, e.timestampNs - prevTime); prevTime = e.timestampNs; }
+        int64_t prev = 0;
+        for (const PlayEvent& e : evs) { putVarint(payload, zigzag(int64_t(e.session) - prev)); prev = e.session; }
+        prev = 0;
+        for (const PlayEvent& e : evs) { putVarint(payload, zigzag(int64_t(e.song) - prev)); prev = e.song; }
+        for (const PlayEvent& e : evs) payload.push_back(static_cast<uint8_t>(e.device));
+        putVarint(block, evs.size());
+        putVarint(block, payload.size());
+        block.insert(block.end(), payload.begin(), payload.end());
+    }
+    void writeLoop() {
+        vector<uint8_t> block;
+        for (;;) {
+            vector<vector<PlayEvent>> batches;
+            {
+                unique_lock<mutex> lk(readyMutex);
+                readyCv.wait(lk, [this] { return !ready.empty() || stopping; });
+                if (ready.empty()) return;
+                batches.swap(ready);
+            }
+            vector<PlayEvent> merged;
+            for (auto& b : batches) merged.insert(merged.end(), b.begin(), b.end());
+            block.clear();
+            encode(merged, block);
+            out.write(reinterpret_cast<const char*>(block.data()), static_cast<streamsize>(block.size()));
+            out.flush();
+            {
+                lock_guard<mutex> lk(readyMutex);
+                committed += batches.size();
+                ++blocks;
+                events += merged.size();
+            }
+            committedCv.notify_all();
+        }
+    }
+public:
+    explicit PlayEventLog(const string& path) : logId(nextLogId()) {
+        struct stat st;
+        bool fresh = ::stat(path.c_str(), &st) != 0 || st.st_size == 0;
+        if (!fresh) {
+            ifstream in(path, ios::binary);
+            char magic[8] = {};
+            if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+                throw runtime_error("Not a play-event log: " + path);
+        }
+        out.open(path, ios::binary | ios::app);
+        if (!out) throw runtime_error("Cannot open play-event log: " + path);
+        if (fresh) out.write(MAGIC, sizeof(MAGIC));
+        writer = thread([this] { writeLoop(); });
+    }
+    ~PlayEventLog() {
+        flush();
+        {
+            lock_guard<mutex> lk(readyMutex);
+            stopping = true;
+        }
+        readyCv.notify_one();
+        writer.join();
+    }
+    PlayEventLog(const PlayEventLog&) = delete;
+    PlayEventLog& operator=(const PlayEventLog&) = delete;
+
+    void append(const PlayEvent& e) { append(span<const PlayEvent>(&e, 1)); }
+    void append(span<const PlayEvent> evs) {
+        ThreadBuffer& buf = local();
+        vector<PlayEvent> full;
+        {
+            lock_guard<mutex> lk(buf.m);
+            buf.events.insert(buf.events.end(), evs.begin(), evs.end());
+            if (buf.events.size() < BUFFER_EVENTS) return;
+            full.reserve(BUFFER_EVENTS);
+            full.swap(buf.events);
+        }
+        submit(move(full));
+    }
+    // Commits everything appended so far, from every thread, before returning
+    void flush() {
+        vector<shared_ptr<ThreadBuffer>> all;
+        {
+            lock_guard<mutex> lk(registryMutex);
+            all = buffers;
+        }
+        for (auto& buf : all) {
+            vector<PlayEvent> partial;
+            {
+                lock_guard<mutex> lk(buf->m);
+                partial.swap(buf->events);
+            }
+            submit(move(partial));
+        }
+        unique_lock<mutex> lk(readyMutex);
+        uint64_t target = submitted;
+        committedCv.wait(lk, [&] { return committed >= target; });
+    }
+    uint64_t committedEvents() { lock_guard<mutex> lk(readyMutex); return events; }
+    uint64_t committedBlocks() { lock_guard<mutex> lk(readyMutex); return blocks; }
+    size_t threadBuffers() { lock_guard<mutex> lk(registryMutex); return buffers.size(); }
+
+    // Decodes a whole log, e.g. for analytics or to seed a scoring strategy
+    static vector<PlayEvent> read(const string& path) {
+        ifstream in(path, ios::binary);
+        if (!in) throw runtime_error("Cannot open play-event log: " + path);
+        vector<uint8_t> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (bytes.size() < sizeof(MAGIC) || memcmp(bytes.data(), MAGIC, sizeof(MAGIC)) != 0)
+            throw runtime_error("Not a play-event log: " + path);
+        vector<PlayEvent> result;
+        const uint8_t* p = bytes.data() + sizeof(MAGIC);
+        const uint8_t* end = bytes.data() + bytes.size();
+        while (p < end) {
+            uint64_t count, size;
+            if (!getVarint(p, end, count) || !getVarint(p, end, size) || size > size_t(end - p)) break;
+            if (count > size / 4) break;   // each event takes at least four bytes
+            const uint8_t* blockEnd = p + size;
+            size_t first = result.size();
+            result.resize(first + count);
+            uint64_t v, time = 0;
+            int64_t session = 0, song = 0;
+            bool ok = true;
+            for (size_t i = 0; ok && i < count; ++i) { ok = getVarint(p, blockEnd, v); time += v; result[first + i].timestampNs = time; }
+            for (size_t i = 0; ok && i < count; ++i) { ok = getVarint(p, blockEnd, v); session += unzigzag(v); result[first + i].session = uint32_t(session); }
+            for (size_t i = 0; ok && i < count; ++i) { ok = getVarint(p, blockEnd, v); song += unzigzag(v); result[first + i].song = SongId(song); }
+            ok = ok && size_t(blockEnd - p) == count;
+            if (!ok) { result.resize(first); break; }
+            for (size_t i = 0; i < count; ++i) result[first + i].device = static_cast<DeviceType>(*p++);
+        }
+        return result;
+    }
+};
+
+// Plays per song, for analytics and for seeding SmartShuffleStrategy scores
+inline unordered_map<SongId, uint64_t> playCounts(span<const PlayEvent> events) {
+    unordered_map<SongId, uint64_t> counts;
+    for (const PlayEvent& e : events) ++counts[e.song];
+    return counts;
+}
+
+// AudioEngine
+class AudioEngine {
+    static constexpr size_t PLAY_BATCH = 64;
+    const Playlist* playlist = nullptr;
+    PlayStrategy* strategy = nullptr;
+    IAudioOutputDevice* device = nullptr;
+    PlaylistSnapshot pinned;                 // keeps a shared version alive while playing
+    const SharedPlaylist* followed = nullptr;
+    uint64_t pinnedVersion = 0;
+    size_t lookahead = 0;
+    deque<SongId> ahead;                     // chosen and prepared, not yet played
+    PlayEventLog* eventLog = nullptr;
+    uint32_t session = 0;
+    DeviceType deviceType = DeviceType::BLUETOOTH;
+    // Fast path, settled once per configuration change rather than per call
+    bool configured = false;
+    SequentialPlayStrategy* sequential = nullptr;   // set when the strategy is sequential
+    optional<SequentialPlayStrategy::Cursor> cursor;
+    bool cursorEnabled = true;
+    // Hot swap: any thread may publish a replacement; the playing thread adopts
+    // it at the next song or batch boundary, so no play call is interrupted.
+    // Tickets count swaps, and what was in use before swap t may be freed once
+    // swapsAdopted reaches t (see adopted()). A device and its logged type are
+    // published as one immutable record, owned by whoever exchanges it out.
+    struct PendingDevice {
+        IAudioOutputDevice* device;
+        optional<DeviceType> type;   // none: keep logging the current type
+    };
+    atomic<PendingDevice*> nextDevice{nullptr};
+    atomic<PlayStrategy*> nextStrategy{nullptr};
+    atomic<uint64_t> swapsRequested{0}, swapsAdopted{0};
+
+    void adoptSwaps() {
+        uint64_t requested = swapsRequested.load(memory_order_acquire);
+        if (requested == swapsAdopted.load(memory_order_relaxed)) return;
+        if (PlayStrategy* ps = nextStrategy.exchange(nullptr, memory_order_acq_rel)) {
+            strategy = ps;   // no reset(): the strategy keeps its own position
+            sequential = ps->asSequential();
+            reconfigure();
+        }
+        if (unique_ptr<PendingDevice> next{nextDevice.exchange(nullptr, memory_order_acq_rel)}) {
+            if (next->type) deviceType = *next->type;
+            installDevice(next->device);
+        }
+        swapsAdopted.store(requested, memory_order_release);
+    }
+
+    void installDevice(IAudioOutputDevice* dev) {
+        device = dev;
+        reconfigure();
+        if (device && playlist)
+            for (SongId id : ahead) device->prepare(playlist->getCatalog().get(id));
+    }
+    void reconfigure() {
+        configured = playlist && strategy && device;
+        cursor.reset();
+    }
+    Song nextDirect() {
+        if (!sequential || !cursorEnabled) return strategy->getNextSong(*playlist);
+        if (!cursor || !cursor->current()) cursor.emplace(sequential->cursor(*playlist));
+        return playlist->getCatalog().get(cursor->next());
+    }
+
+    void logPlays(const SongId* ids, size_t n) {
+        PlayEvent evs[PLAY_BATCH];
+        uint64_t now = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count());
+        for (size_t i = 0; i < n; ++i) evs[i] = {now, session, ids[i], deviceType};
+        eventLog->append(span<const PlayEvent>(evs, n));
+    }
+
+    // Tops the window up to `lookahead` songs, preparing each on the device
+    void prefetch() {
+        SongId ids[PLAY_BATCH];
+        while (ahead.size() < lookahead) {
+            size_t n = strategy->fillNext(*playlist, span<SongId>(ids, min(lookahead - ahead.size(), PLAY_BATCH)));
+            if (n == 0) return;
+            for (size_t i = 0; i < n; ++i) {
+                device->prepare(playlist->getCatalog().get(ids[i]));
+                ahead.push_back(ids[i]);
+            }
+        }
+    }
+    // Next songs in strategy order: the prepared window first, then fresh picks
+    size_t nextSongs(span<SongId> out) {
+        size_t n = min(out.size(), ahead.size());
+        copy_n(ahead.begin(), n, out.begin());
+        ahead.erase(ahead.begin(), ahead.begin() + static_cast<ptrdiff_t>(n));
+        if (n < out.size()) n += strategy->fillNext(*playlist, out.subspan(n));
+        return n;
+    }
+
+    void pin(PlaylistSnapshot snap) { pinned = move(snap); playlist = pinned.get(); reconfigure(); }
+    // Picks up a newer shared version; called between batches, never mid-batch
+    void refresh() {
+        if (!followed) return;
+        uint64_t v = followed->getVersion();
+        if (v != pinnedVersion) { pinnedVersion = v; pin(followed->snapshot()); }
+    }
+public:
+    AudioEngine() = default;
+    AudioEngine(const AudioEngine&) = delete;
+    AudioEngine& operator=(const AudioEngine&) = delete;
+    ~AudioEngine() { delete nextDevice.load(memory_order_acquire); }
+
+    void loadPlaylist(const Playlist& pl) { pinned.reset(); followed = nullptr; playlist = &pl; ahead.clear(); reconfigure(); }
+    // Plays one fixed version
+    void loadPlaylist(PlaylistSnapshot snap) { followed = nullptr; pin(move(snap)); ahead.clear(); }
+    // Plays the latest published version of sp, which must outlive the engine.
+    // Songs already in the lookahead window still play after an edit.
+    void follow(const SharedPlaylist& sp) {
+        followed = &sp;
+        pinnedVersion = sp.getVersion();
+        pin(sp.snapshot());
+        ahead.clear();
+    }
+    // setStrategy/setDevice take effect immediately and drop any pending swap
+    void setStrategy(PlayStrategy* ps) {
+        nextStrategy.store(nullptr, memory_order_relaxed);
+        strategy = ps;
+        strategy->reset();
+        sequential = ps->asSequential();
+        ahead.clear();
+        reconfigure();
+    }
+    // Thread-safe replacements that keep the strategy position and lookahead
+    // window; each returns its ticket. A device type given with the device is
+    // what later plays are logged as, from the same switch-over point.
+    uint64_t swapDevice(IAudioOutputDevice* dev, optional<DeviceType> type = nullopt) {
+        delete nextDevice.exchange(new PendingDevice{dev, type}, memory_order_acq_rel);   // superseded swap
+        return swapsRequested.fetch_add(1, memory_order_acq_rel) + 1;
+    }
+    uint64_t swapStrategy(PlayStrategy* ps) {
+        nextStrategy.store(ps, memory_order_release);
+        return swapsRequested.fetch_add(1, memory_order_acq_rel) + 1;
+    }
+    // True once the engine has stopped using whatever predates swap `ticket`
+    bool adopted(uint64_t ticket) const { return swapsAdopted.load(memory_order_acquire) >= ticket; }
+    // Sequential strategies play through a cached cursor unless disabled (for benchmarks)
+    void setCursorFastPath(bool enabled) { cursorEnabled = enabled; cursor.reset(); }
+    // Picks the next k songs ahead of time and prepares them on the device, so
+    // each play hands over an already-prepared track; 0 disables lookahead
+    void setLookahead(size_t k) { lookahead = k; }
+    size_t getLookahead() const { return lookahead; }
+    // Records every play in log (null to stop); the log must outlive the engine.
+    // Not synchronized with playback: call it between plays, from the playing thread.
+    void setEventLog(PlayEventLog* log, uint32_t sessionId, DeviceType type) {
+        eventLog = log;
+        session = sessionId;
+        deviceType = type;
+    }
+    // The window survives a device change and is prepared again on the new device
+    void setDevice(IAudioOutputDevice* dev) {
+        delete nextDevice.exchange(nullptr, memory_order_acq_rel);
+        installDevice(dev);
+    }
+    void playNext() {
+        SPOTIFY_TIME(ENGINE_PLAY_NEXT);
+        SPOTIFY_COUNT_THROWS();
+        refresh();
+        adoptSwaps();
+        if (!configured) throw runtime_error("AudioEngine not configured");
+        SPOTIFY_COUNT_IF(playlist->size() == 0, EMPTY_PLAYLIST);
+        Song s;
+        {
+            SPOTIFY_TIME(STRATEGY_NEXT_SONG);
+            if (lookahead == 0 && ahead.empty()) s = nextDirect();
+            else {
+                if (ahead.empty()) prefetch();
+                s = playlist->getCatalog().get(ahead.front());
+                ahead.pop_front();
+            }
+        }
+        {
+            SPOTIFY_TIME(DEVICE_PLAY_SOUND);
+            device->playSound(s);
+        }
+        if (eventLog) logPlays(&s.id, 1);
+        SPOTIFY_COUNT(PLAYS, 1);
+        if (lookahead > 0) prefetch();
+    }
+    // Validates once, then pulls songs from the strategy and pushes them to the
+    // device PLAY_BATCH at a time instead of dispatching per song
+    void playMultiple(size_t count) {
+        SPOTIFY_COUNT_THROWS();
+        refresh();
+        adoptSwaps();
+        if (!configured) throw runtime_error("AudioEngine not configured");
+        SPOTIFY_COUNT_IF(count > 0 && playlist->size() == 0, EMPTY_PLAYLIST);
+        SongId ids[PLAY_BATCH];
+        Song songs[PLAY_BATCH];
+        const SongCatalog& catalog = playlist->getCatalog();
+        while (count > 0) {
+            SPOTIFY_TIME(ENGINE_PLAY_BATCH);
+            size_t n;
+            {
+                SPOTIFY_TIME(STRATEGY_FILL_NEXT);
+                n = nextSongs(span<SongId>(ids, min(count, PLAY_BATCH)));
+            }
+            if (n == 0) break;
+            for (size_t i = 0; i < n; ++i) songs[i] = catalog.get(ids[i]);
+            {
+                SPOTIFY_TIME(DEVICE_PLAY_BATCH);
+                device->playBatch(span<const Song>(songs, n));
+            }
+            if (eventLog) logPlays(ids, n);
+            SPOTIFY_COUNT(PLAYS, n);
+            count -= n;
+            if (lookahead > 0) prefetch();
+            refresh();
+            adoptSwaps();
+        }
+    }
+};
+
+// StaticAudioEngine: the strategy and device are members of known final type,
+// so calls bind statically and can inline, with no heap indirection. For fixed
+// deployments; AudioEngine remains the runtime-configurable fallback.
+template <class Strategy, class Device>
+class StaticAudioEngine {
+    static_assert(is_base_of_v<PlayStrategy, Strategy>, "Strategy must implement PlayStrategy");
+    static_assert(is_base_of_v<IAudioOutputDevice, Device>, "Device must implement IAudioOutputDevice");
+    static constexpr size_t PLAY_BATCH = 64;
+    const Playlist* playlist = nullptr;
+    Strategy strategy;
+    Device device;
+public:
+    StaticAudioEngine() = default;
+    StaticAudioEngine(Strategy ps, Device dev) : strategy(move(ps)), device(move(dev)) {}
+    void loadPlaylist(const Playlist& pl) { playlist = &pl; strategy.reset(); }
+    Strategy& getStrategy() { return strategy; }
+    Device& getDevice() { return device; }
+    void playNext() {
+        SPOTIFY_TIME(ENGINE_PLAY_NEXT);
+        SPOTIFY_COUNT_THROWS();
+        if (!playlist) throw runtime_error("AudioEngine not configured");
+        device.Device::playSound(strategy.Strategy::getNextSong(*playlist));
+        SPOTIFY_COUNT(PLAYS, 1);
+    }
+    void playMultiple(size_t count) {
+        SPOTIFY_COUNT_THROWS();
+        if (!playlist) throw runtime_error("AudioEngine not configured");
+        SongId ids[PLAY_BATCH];
+        Song songs[PLAY_BATCH];
+        const SongCatalog& catalog = playlist->getCatalog();
+        while (count > 0) {
+            SPOTIFY_TIME(ENGINE_PLAY_BATCH);
+            size_t n = strategy.Strategy::fillNext(*playlist, span<SongId>(ids, min(count, PLAY_BATCH)));
+            if (n == 0) break;
+            for (size_t i = 0; i < n; ++i) songs[i] = catalog.get(ids[i]);
+            device.Device::playBatch(span<const Song>(songs, n));
+            SPOTIFY_COUNT(PLAYS, n);
+            count -= n;
+        }
+    }
+};
+
+// Facade
+class MusicPlayerFacade {
+    PlaylistManager playlistManager;
+    DeviceManager deviceManager;
+    unique_ptr<PlayStrategy> strategyPtr;
+    AudioEngine engine;
+    unique_ptr<SearchIndex> searchIndex;
+    PlayEventLog* eventLog = nullptr;
+    DeviceType currentDevice = DeviceType::BLUETOOTH;
+    vector<pair<uint64_t, unique_ptr<PlayStrategy>>> retiredStrategies;   // (ticket, strategy)
+
+    void reclaim() {
+        erase_if(retiredStrategies, [&](const auto& r) { return engine.adopted(r.first); });
+    }
+public:
+    void addSongToPlaylist(const Song& song) {
+        playlistManager.addSong(song);
+    }
+    void removeSongFromPlaylist(size_t index) {
+        playlistManager.removeSong(index);
+    }
+    void setRemovalMode(RemovalMode mode) {
+        playlistManager.setRemovalMode(mode);
+    }
+    void prewarmDevices(initializer_list<DeviceType> types) { deviceManager.prewarm(types); }
+    // Reconfiguring resets strategy state, so it is the safe point to compact
+    void configure(DeviceType dt, PlayStrategyType pst) {
+        playlistManager.compactIfNeeded();
+        deviceManager.selectDevice(dt);
+        strategyPtr = StrategyManager::createStrategy(pst);
+        if (!strategyPtr) throw runtime_error("Invalid strategy type");
+        engine.setDevice(deviceManager.getDevice());
+        engine.setStrategy(strategyPtr.get());
+        engine.loadPlaylist(playlistManager.getPlaylist());
+        currentDevice = dt;
+        engine.setEventLog(eventLog, 0, dt);
+    }
+    void configureCustom(DeviceType dt, vector<size_t> customQueue) {
+        deviceManager.selectDevice(dt);
+        auto cqs = make_unique<CustomQueueStrategy>();
+        cqs->setQueue(move(customQueue));
+        vector<size_t> slotMap = playlistManager.compactIfNeeded();
+        if (!slotMap.empty()) cqs->remap(slotMap);
+        cqs->validate(playlistManager.getPlaylist());
+        strategyPtr = move(cqs);
+        engine.setDevice(deviceManager.getDevice());
+        engine.setStrategy(strategyPtr.get());
+        engine.loadPlaylist(playlistManager.getPlaylist());
+        currentDevice = dt;
+        engine.setEventLog(eventLog, 0, dt);
+    }
+    // Hot swaps: unlike configure(), these keep the strategy's position and do
+    // not rewire the engine, and may run while another thread is playing. The
+    // facade's other calls are not thread-safe, so make these from one
+    // controlling thread. Devices come from the DeviceManager pool, so a switch
+    // is a pointer swap; the engine adopts the device and its logged type together.
+    void switchDevice(DeviceType dt) {
+        deviceManager.selectDevice(dt);
+        engine.swapDevice(deviceManager.getDevice(), dt);
+        currentDevice = dt;
+    }
+    // The replaced strategy is kept until the engine has let go of it
+    void switchStrategy(PlayStrategyType pst) {
+        unique_ptr<PlayStrategy> next = StrategyManager::createStrategy(pst);
+        if (!next) throw runtime_error("Invalid strategy type");
+        uint64_t ticket = engine.swapStrategy(next.get());
+        if (strategyPtr) retiredStrategies.emplace_back(ticket, move(strategyPtr));
+        strategyPtr = move(next);
+        reclaim();
+    }
+    void playNext() { engine.playNext(); }
+    void playMultiple(size_t count) { engine.playMultiple(count); }
+    void setLookahead(size_t k) { engine.setLookahead(k); }
+    // Listening history; the log must outlive the player (null to stop)
+    void setEventLog(PlayEventLog* log) {
+        eventLog = log;
+        engine.setEventLog(log, 0, currentDevice);
+    }
+    const Playlist& getPlaylist() const {
+        return playlistManager.getPlaylist();
+    }
+    // The index is rebuilt lazily when songs were added since the last search
+    vector<SearchHit> search(string_view query, size_t k = 10) {
+        const SongCatalog& catalog = playlistManager.getCatalog();
+        if (!searchIndex) searchIndex = make_unique<SearchIndex>(catalog);
+        else if (searchIndex->indexedSongs() != catalog.size()) searchIndex->rebuild();
+        return searchIndex->search(query, k);
+    }
+};
+
+// WorkStealingPool: fixed worker threads, each with its own task deque. Owners
+// pop newest-first, idle workers steal oldest-first from the others, so one
+// worker stuck on a long queue does not hold everyone else's tasks hostage.
+class WorkStealingPool {
+    struct WorkerQueue {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> queued{0};     // sitting in a deque
+    atomic<size_t> pending{0};    // submitted and not finished
+    atomic<size_t> nextQueue{0};
+    bool stopping = false;
+    mutex idleMutex;
+    condition_variable idleCv, doneCv;
+    static inline thread_local const WorkStealingPool* currentPool = nullptr;
+    static inline thread_local size_t currentWorker = 0;
+
+    bool popOwn(size_t self, function<void()>& task) {
+        WorkerQueue& q = *queues[self];
+        lock_guard<mutex> lk(q.m);
+        if (q.tasks.empty()) return false;
+        task = move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+    bool steal(size_t self, function<void()>& task) {
+        for (size_t i = 1; i < queues.size(); ++i) {
+            WorkerQueue& q = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> lk(q.m);
+            if (q.tasks.empty()) continue;
+            task = move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+    void run(size_t self) {
+        currentPool = this;
+        currentWorker = self;
+        for (;;) {
+            function<void()> task;
+            if (popOwn(self, task) || steal(self, task)) {
+                queued.fetch_sub(1, memory_order_relaxed);
+                task();
+                if (pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+                    lock_guard<mutex> lk(idleMutex);
+                    doneCv.notify_all();
+                }
+                continue;
+            }
+            unique_lock<mutex> lk(idleMutex);
+            idleCv.wait(lk, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) return;
+        }
+    }
+public:
+    explicit WorkStealingPool(size_t threads = thread::hardware_concurrency()) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; ++i) queues.push_back(make_unique<WorkerQueue>());
+        for (size_t i = 0; i < threads; ++i) workers.emplace_back([this, i] { run(i); });
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lk(idleMutex);
+            stopping = true;
+        }
+        idleCv.notify_all();
+        for (thread& t : workers) t.join();
+    }
+    // Tasks submitted from a worker go to that worker's own deque
+    void submit(function<void()> task) {
+        size_t target = currentPool == this ? currentWorker
+                                            : nextQueue.fetch_add(1, memory_order_relaxed) % queues.size();
+        pending.fetch_add(1, memory_order_relaxed);
+        {
+            lock_guard<mutex> lk(queues[target]->m);
+            queues[target]->tasks.push_back(move(task));
+        }
+        queued.fetch_add(1, memory_order_release);
+        { lock_guard<mutex> lk(idleMutex); }
+        idleCv.notify_one();
+    }
+    // Blocks until every submitted task (including ones they submit) has finished
+    void wait() {
+        unique_lock<mutex> lk(idleMutex);
+        doneCv.wait(lk, [this] { return pending.load(memory_order_acquire) == 0; });
+    }
+    size_t workerCount() const { return workers.size(); }
+};
+
+// PlaybackSession: one listener's strategy, device and engine. The playlist is
+// shared read-only between sessions; all mutable playback state is per session.
+class PlaybackSession {
+    unique_ptr<PlayStrategy> strategy;
+    unique_ptr<IAudioOutputDevice> device;
+    AudioEngine engine;
+    atomic<size_t> pendingPlays{0};
+    atomic<size_t> failures{0};
+    mutex retireMutex;
+    vector<pair<uint64_t, unique_ptr<IAudioOutputDevice>>> retiredDevices;   // (ticket, device)
+    friend class SessionManager;
+public:
+    PlaybackSession(const Playlist& playlist, unique_ptr<PlayStrategy> ps, unique_ptr<IAudioOutputDevice> dev)
+        : strategy(move(ps)), device(move(dev)) {
+        engine.setDevice(device.get());
+        engine.setStrategy(strategy.get());
+        engine.loadPlaylist(playlist);
+    }
+    PlaybackSession(const SharedPlaylist& playlist, unique_ptr<PlayStrategy> ps, unique_ptr<IAudioOutputDevice> dev)
+        : strategy(move(ps)), device(move(dev)) {
+        engine.setDevice(device.get());
+        engine.setStrategy(strategy.get());
+        engine.follow(playlist);
+    }
+    size_t getFailures() const { return failures.load(memory_order_relaxed); }
+    // Safe while a slice is playing: the old device is freed only once the
+    // engine has adopted the swap (or a later one)
+    // type is what later plays are logged as, adopted together with dev
+    void switchDevice(unique_ptr<IAudioOutputDevice> dev, DeviceType type) {
+        if (!dev) throw runtime_error("Failed to create device");
+        lock_guard<mutex> lk(retireMutex);
+        uint64_t ticket = engine.swapDevice(dev.get(), type);
+        retiredDevices.emplace_back(ticket, move(device));
+        device = move(dev);
+        erase_if(retiredDevices, [&](const auto& r) { return engine.adopted(r.first); });
+    }
+};
+
+// SessionManager: runs many independent sessions on one WorkStealingPool.
+// A session has at most one task in flight, and each task plays at most
+// SLICE songs before re-queueing itself, so busy sessions interleave fairly.
+// A plain Playlist must not be mutated while sessions are playing; a
+// SharedPlaylist may be edited at any time and sessions pick up new versions.
+class SessionManager {
+public:
+    using SessionId = size_t;
+private:
+    static constexpr size_t SLICE = 64;
+    const Playlist* playlist = nullptr;
+    const SharedPlaylist* shared = nullptr;
+    vector<unique_ptr<PlaybackSession>> sessions;
+    bool timedPlays = false;
+    mutex latencyMutex;
+    vector<unique_ptr<metrics::LatencyHistogram>> latencies;   // one per worker, each with a single writer
+    WorkStealingPool pool;
+
+    metrics::LatencyHistogram& workerLatency() {
+        thread_local const SessionManager* owner = nullptr;
+        thread_local metrics::LatencyHistogram* histogram = nullptr;
+        if (owner != this) {
+            lock_guard<mutex> lk(latencyMutex);
+            histogram = latencies.emplace_back(make_unique<metrics::LatencyHistogram>()).get();
+            owner = this;
+        }
+        return *histogram;
+    }
+    void schedule(PlaybackSession* s) {
+        pool.submit([this, s] { runSlice(*s); });
+    }
+    void runSlice(PlaybackSession& s) {
+        size_t n = min(s.pendingPlays.load(memory_order_acquire), SLICE);
+        try {
+            if (!timedPlays) s.engine.playMultiple(n);
+            else {
+                metrics::LatencyHistogram& h = workerLatency();
+                for (size_t i = 0; i < n; ++i) {
+                    auto start = chrono::steady_clock::now();
+                    s.engine.playNext();
+                    h.record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - start).count()));
+                }
+            }
+        } catch (const exception&) {
+            s.failures.fetch_add(1, memory_order_relaxed);
+        }
+        if (s.pendingPlays.fetch_sub(n, memory_order_acq_rel) > n) schedule(&s);
+    }
+public:
+    explicit SessionManager(const Playlist& pl, size_t workers = thread::hardware_concurrency())
+        : playlist(&pl), pool(workers) {}
+    explicit SessionManager(const SharedPlaylist& sp, size_t workers = thread::hardware_concurrency())
+        : shared(&sp), pool(workers) {}
+    ~SessionManager() { pool.wait(); }
+    // Sessions are opened from the controlling thread, not from inside tasks
+    SessionId openSession(unique_ptr<IAudioOutputDevice> device, unique_ptr<PlayStrategy> strategy) {
+        if (!device) throw runtime_error("Failed to create device");
+        if (!strategy) throw runtime_error("Invalid strategy type");
+        if (shared) sessions.push_back(make_unique<PlaybackSession>(*shared, move(strategy), move(device)));
+        else sessions.push_back(make_unique<PlaybackSession>(*playlist, move(strategy), move(device)));
+        return sessions.size() - 1;
+    }
+    SessionId openSession(DeviceType dt, PlayStrategyType pst) {
+        return openSession(DeviceFactory::create(dt), StrategyManager::createStrategy(pst));
+    }
+    // Queues count plays; returns immediately
+    void play(SessionId id, size_t count) {
+        PlaybackSession& s = *sessions.at(id);
+        if (count > 0 && s.pendingPlays.fetch_add(count, memory_order_acq_rel) == 0) schedule(&s);
+    }
+    void switchDevice(SessionId id, unique_ptr<IAudioOutputDevice> device, DeviceType type) {
+        sessions.at(id)->switchDevice(move(device), type);
+    }
+    void switchDevice(SessionId id, DeviceType type) { switchDevice(id, DeviceFactory::create(type), type); }
+    void wait() { pool.wait(); }
+    // Plays song by song through playNext and records each call's latency, for
+    // load tests; set it before queueing plays
+    void setTimedPlays(bool on) { timedPlays = on; }
+    metrics::HistogramSnapshot playLatency() {
+        metrics::HistogramSnapshot snap;
+        lock_guard<mutex> lk(latencyMutex);
+        for (const auto& h : latencies) h->addTo(snap.counts);
+        return snap;
+    }
+    const PlaybackSession& getSession(SessionId id) const { return *sessions.at(id); }
+    size_t sessionCount() const { return sessions.size(); }
+    size_t workerCount() const { return pool.workerCount(); }
+};
+
+// Parallel bulk operations over large playlists, run as chunked tasks on a
+// WorkStealingPool. Call them from outside the pool: they block until their
+// own tasks finish. Results are deterministic regardless of worker count.
+namespace bulk {
+constexpr size_t MIN_CHUNK = 16 * 1024;
+
+inline size_t chunkCount(const WorkStealingPool& pool, size_t n) {
+    return max<size_t>(1, min(pool.workerCount() * 4, n / MIN_CHUNK));
+}
+
+// Runs body(begin, end, chunk) over [0, n) split into `chunks` near-equal
+// ranges; the first exception from any chunk is rethrown here
+template <class F>
+void parallelFor(WorkStealingPool& pool, size_t n, size_t chunks, F&& body) {
+    if (chunks <= 1) {
+        if (n > 0) body(size_t(0), n, size_t(0));
+        return;
+    }
+    latch done(static_cast<ptrdiff_t>(chunks));
+    mutex errorMutex;
+    exception_ptr error;
+    for (size_t c = 0; c < chunks; ++c) {
+        pool.submit([&, c] {
+            try {
+                body(c * n / chunks, (c + 1) * n / chunks, c);
+            } catch (...) {
+                lock_guard<mutex> lk(errorMutex);
+                if (!error) error = current_exception();
+            }
+            done.count_down();
+        });
+    }
+    done.wait();
+    if (error) rethrow_exception(error);
+}
+template <class F>
+void parallelFor(WorkStealingPool& pool, size_t n, F&& body) {
+    parallelFor(pool, n, chunkCount(pool, n), forward<F>(body));
+}
+
+// Sorts chunks in parallel, then merges adjacent runs pairwise, one parallel
+// round per doubling of the run length
+template <class T, class Less>
+void parallelSort(WorkStealingPool& pool, vector<T>& values, Less less) {
+    size_t n = values.size();
+    size_t chunks = chunkCount(pool, n);
+    parallelFor(pool, n, chunks, [&](size_t b, size_t e, size_t) { sort(values.begin() + b, values.begin() + e, less); });
+    if (chunks == 1) return;
+    vector<T> buffer(n);
+    vector<T>* from = &values;
+    vector<T>* to = &buffer;
+    for (size_t width = 1; width < chunks; width *= 2) {
+        size_t pairs = (chunks + 2 * width - 1) / (2 * width);
+        parallelFor(pool, pairs, pairs, [&](size_t pb, size_t pe, size_t) {
+            for (size_t pr = pb; pr < pe; ++pr) {
+                size_t lo = pr * 2 * width * n / chunks;
+                size_t mid = min(chunks, pr * 2 * width + width) * n / chunks;
+                size_t hi = min(chunks, (pr + 1) * 2 * width) * n / chunks;
+                merge(from->begin() + lo, from->begin() + mid, from->begin() + mid, from->begin() + hi,
+                      to->begin() + lo, less);
+            }
+        });
+        swap(from, to);
+    }
+    if (from != &values) values.swap(buffer);
+}
+
+// Keeps the indices i in [0, n) for which keep(i) holds, in order. keep runs
+// once per index: chunks collect their survivors, an exclusive scan gives each
+// chunk its offset, then they copy into place.
+template <class Keep>
+vector<size_t> parallelSelect(WorkStealingPool& pool, size_t n, Keep keep) {
+    size_t chunks = chunkCount(pool, n);
+    vector<vector<size_t>> kept(chunks);
+    vector<size_t> offsets(chunks + 1, 0);
+    parallelFor(pool, n, chunks, [&](size_t b, size_t e, size_t c) {
+        for (size_t i = b; i < e; ++i) if (keep(i)) kept[c].push_back(i);
+        offsets[c + 1] = kept[c].size();
+    });
+    if (chunks == 1) return move(kept[0]);
+    partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    vector<size_t> out(offsets.back());
+    parallelFor(pool, chunks, chunks, [&](size_t b, size_t e, size_t) {
+        for (size_t c = b; c < e; ++c) copy(kept[c].begin(), kept[c].end(), out.begin() + static_cast<ptrdiff_t>(offsets[c]));
+    });
+    return out;
+}
+
+enum class SortKey { ARTIST_TITLE, TITLE_ARTIST };
+
+// Tables indexed by SongId are only used while the catalog is at most this many
+// times the input, so no step costs more than O(input) to set up
+constexpr size_t DENSE_TABLE_FACTOR = 4;
+
+// The distinct songs among slots[live[i]], numbered in ascending SongId order
+struct DistinctSongs {
+    static constexpr uint32_t NONE = numeric_limits<uint32_t>::max();
+    vector<SongId> songs;
+    vector<uint32_t> table;                  // by SongId, when the catalog is small enough
+    unordered_map<SongId, uint32_t> sparse;  // otherwise
+    uint32_t indexOf(SongId id) const { return table.empty() ? sparse.find(id)->second : table[id]; }
+};
+inline DistinctSongs distinctSongs(span<const SongId> slots, span<const size_t> live, size_t catalogSize) {
+    DistinctSongs d;
+    if (catalogSize <= DENSE_TABLE_FACTOR * live.size()) {
+        d.table.assign(catalogSize, DistinctSongs::NONE);
+        for (size_t i : live) d.table[slots[i]] = 0;
+        for (size_t id = 0; id < catalogSize; ++id)
+            if (d.table[id] == 0) {
+                d.table[id] = static_cast<uint32_t>(d.songs.size());
+                d.songs.push_back(static_cast<SongId>(id));
+            }
+        return d;
+    }
+    for (size_t i : live) d.sparse.emplace(slots[i], 0);
+    d.songs.reserve(d.sparse.size());
+    for (const auto& entry : d.sparse) d.songs.push_back(entry.first);
+    sort(d.songs.begin(), d.songs.end());
+    for (size_t k = 0; k < d.songs.size(); ++k) d.sparse[d.songs[k]] = static_cast<uint32_t>(k);
+    return d;
+}
+
+// Live slots ordered by key (ties keep slot order), ready for CustomQueueStrategy.
+// Only the distinct songs present are ranked by text, so the cost follows the
+// playlist rather than the catalog, and the big sort compares integers only.
+inline vector<size_t> sortedSlots(WorkStealingPool& pool, const Playlist& playlist, SortKey key) {
+    const SongCatalog& catalog = playlist.getCatalog();
+    span<const SongId> slots = playlist.getSongs();
+    if (slots.size() > numeric_limits<uint32_t>::max()) throw runtime_error("Playlist too large to sort");
+    vector<size_t> live = parallelSelect(pool, slots.size(), [&](size_t i) { return slots[i] != INVALID_SONG_ID; });
+    DistinctSongs distinct = distinctSongs(slots, live, catalog.size());
+    // byText[r] is the distinct song ranked r
+    vector<uint32_t> byText(distinct.songs.size());
+    iota(byText.begin(), byText.end(), uint32_t(0));
+    parallelSort(pool, byText, [&](uint32_t a, uint32_t b) {
+        Song x = catalog.get(distinct.songs[a]), y = catalog.get(distinct.songs[b]);
+        return key == SortKey::ARTIST_TITLE ? tie(x.artist, x.title) < tie(y.artist, y.title)
+                                            : tie(x.title, x.artist) < tie(y.title, y.artist);
+    });
+    vector<uint32_t> rank(byText.size());
+    parallelFor(pool, byText.size(), [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; ++i) rank[byText[i]] = static_cast<uint32_t>(i);
+    });
+    vector<uint32_t> slotRank(live.size());
+    parallelFor(pool, live.size(), [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; ++i) slotRank[i] = rank[distinct.indexOf(slots[live[i]])];
+    });
+    size_t chunks = chunkCount(pool, live.size());
+    if (chunks * rank.size() <= live.size()) {
+        // Few distinct songs: a stable counting sort by rank is O(n). Each chunk
+        // counts its ranks, a rank-major scan gives every (rank, chunk) its start
+        vector<size_t> counts(chunks * rank.size(), 0);
+        parallelFor(pool, live.size(), chunks, [&](size_t b, size_t e, size_t c) {
+            size_t* mine = counts.data() + c * rank.size();
+            for (size_t i = b; i < e; ++i) ++mine[slotRank[i]];
+        });
+        size_t total = 0;
+        for (size_t r = 0; r < rank.size(); ++r)
+            for (size_t c = 0; c < chunks; ++c) total += exchange(counts[c * rank.size() + r], total);
+        vector<size_t> sorted(live.size());
+        parallelFor(pool, live.size(), chunks, [&](size_t b, size_t e, size_t c) {
+            size_t* mine = counts.data() + c * rank.size();
+            for (size_t i = b; i < e; ++i) sorted[mine[slotRank[i]]++] = live[i];
+        });
+        return sorted;
+    }
+    vector<uint64_t> keys(live.size());
+    parallelFor(pool, live.size(), [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; ++i) keys[i] = (uint64_t(slotRank[i]) << 32) | live[i];
+    });
+    parallelSort(pool, keys, less<uint64_t>());
+    parallelFor(pool, keys.size(), [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; ++i) live[i] = static_cast<size_t>(keys[i] & 0xFFFFFFFFu);
+    });
+    return live;
+}
+
+// Live slots whose song satisfies pred, in slot order
+template <class Pred>
+vector<size_t> filterSlots(WorkStealingPool& pool, const Playlist& playlist, Pred pred) {
+    span<const SongId> slots = playlist.getSongs();
+    const SongCatalog& catalog = playlist.getCatalog();
+    return parallelSelect(pool, slots.size(), [&](size_t i) {
+        return slots[i] != INVALID_SONG_ID && pred(catalog.get(slots[i]));
+    });
+}
+
+// First occurrence of each song, in order, skipping tombstones. The catalog
+// interns (title, artist) pairs, so equal pairs already share a SongId and the
+// id stands in for the pair's hash. A first-index table by SongId is used when
+// the catalog is small next to the input; otherwise (id, index) keys are
+// sorted, so the cost follows the input size, not the catalog's.
+inline vector<SongId> dedupeIds(WorkStealingPool& pool, span<const SongId> slots, size_t catalogSize) {
+    if (slots.size() > numeric_limits<uint32_t>::max()) throw runtime_error("Playlist too large to dedupe");
+    vector<size_t> keep;
+    if (catalogSize <= DENSE_TABLE_FACTOR * slots.size()) {
+        vector<atomic<size_t>> first(catalogSize);
+        parallelFor(pool, first.size(), [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; ++i) first[i].store(numeric_limits<size_t>::max(), memory_order_relaxed);
+        });
+        parallelFor(pool, slots.size(), [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; ++i) {
+                if (slots[i] == INVALID_SONG_ID) continue;
+                atomic<size_t>& f = first[slots[i]];
+                size_t cur = f.load(memory_order_relaxed);
+                while (i < cur && !f.compare_exchange_weak(cur, i, memory_order_relaxed)) {}
+            }
+        });
+        keep = parallelSelect(pool, slots.size(), [&](size_t i) {
+            return slots[i] != INVALID_SONG_ID && first[slots[i]].load(memory_order_relaxed) == i;
+        });
+    } else {
+        vector<size_t> live = parallelSelect(pool, slots.size(), [&](size_t i) { return slots[i] != INVALID_SONG_ID; });
+        vector<uint64_t> keys(live.size());
+        parallelFor(pool, live.size(), [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; ++i) keys[i] = (uint64_t(slots[live[i]]) << 32) | live[i];
+        });
+        parallelSort(pool, keys, less<uint64_t>());
+        keep = parallelSelect(pool, keys.size(), [&](size_t i) {
+            return i == 0 || (keys[i] >> 32) != (keys[i - 1] >> 32);
+        });
+        parallelFor(pool, keep.size(), [&](size_t b, size_t e, size_t) {
+            for (size_t i = b; i < e; ++i) keep[i] = static_cast<size_t>(keys[keep[i]] & 0xFFFFFFFFu);
+        });
+        parallelSort(pool, keep, less<size_t>());
+    }
+    vector<SongId> ids(keep.size());
+    parallelFor(pool, keep.size(), [&](size_t b, size_t e, size_t) {
+        for (size_t i = b; i < e; ++i) ids[i] = slots[keep[i]];
+    });
+    return ids;
+}
+
+inline Playlist dedupe(WorkStealingPool& pool, const Playlist& playlist) {
+    Playlist out(playlist.getCatalog());
+    out.addSongs(dedupeIds(pool, playlist.getSongs(), playlist.getCatalog().size()));
+    return out;
+}
+
+// Union of a and b: a's songs in order, then b's songs not already present,
+// each once. Both playlists must share a catalog.
+inline Playlist merge(WorkStealingPool& pool, const Playlist& a, const Playlist& b) {
+    if (&a.getCatalog() != &b.getCatalog()) throw runtime_error("Playlists use different catalogs");
+    span<const SongId> as = a.getSongs(), bs = b.getSongs();
+    vector<SongId> joined(as.size() + bs.size());
+    parallelFor(pool, joined.size(), [&](size_t lo, size_t hi, size_t) {
+        for (size_t i = lo; i < hi; ++i) joined[i] = i < as.size() ? as[i] : bs[i - as.size()];
+    });
+    Playlist out(a.getCatalog());
+    out.addSongs(dedupeIds(pool, joined, a.getCatalog().size()));
+    return out;
+}
+}  // namespace bulk
+
+// Benchmarks (run with --bench [max playlist size])
+namespace bench {
+volatile uint64_t sink;
+
+// Repeats body(iterations) with doubling iteration counts until one run takes
+// at least MIN_TIME, then reports that run's ns per iteration
+template <class F>
+double nsPerOp(F&& body) {
+    constexpr auto MIN_TIME = chrono::milliseconds(50);
+    for (size_t iters = 1;; iters *= 2) {
+        auto start = chrono::steady_clock::now();
+        body(iters);
+        auto elapsed = chrono::steady_clock::now() - start;
+        if (elapsed >= MIN_TIME || iters >= (size_t(1) << 40))
+            return chrono::duration<double, nano>(elapsed).count() / static_cast<double>(iters);
+    }
+}
+
+void report(string_view name, size_t size, double ns) {
+    cout << left << setw(40) << name << right << setw(12) << size
+         << setw(12) << fixed << setprecision(2) << ns << " ns/op\n";
+}
+
+// Playlist of `size` slots over a small catalog: the same tracks recur, which is
+// also how real playlists share catalog entries
+void fillPlaylist(SongCatalog& catalog, Playlist& playlist, size_t size) {
+    constexpr size_t DISTINCT = 1000;
+    while (catalog.size() < DISTINCT)
+        catalog.addSong("Title " + to_string(catalog.size()), "Artist " + to_string(catalog.size() % 100));
+    for (size_t i = 0; i < size; ++i) playlist.addSong(static_cast<SongId>(i % DISTINCT));
+}
+
+vector<size_t> playlistSizes(size_t maxSize) {
+    vector<size_t> sizes;
+    for (size_t n = 10; n <= maxSize; n *= 10) sizes.push_back(n);
+    return sizes;
+}
+
+void strategies(size_t maxSize) {
+    for (size_t n : playlistSizes(maxSize)) {
+        SongCatalog catalog;
+        Playlist playlist(catalog);
+        fillPlaylist(catalog, playlist, n);
+        auto run = [&](string_view name, PlayStrategy& strategy) {
+            report(name, n, nsPerOp([&](size_t iters) {
+                for (size_t i = 0; i < iters; ++i) sink = strategy.getNextSong(playlist).id;
+            }));
+        };
+        SequentialPlayStrategy sequential;
+        run("SequentialPlayStrategy::getNextSong", sequential);
+        SequentialPlayStrategy::Cursor cursor = sequential.cursor(playlist);
+        report("SequentialPlayStrategy::Cursor::next", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) sink = cursor.next();
+        }));
+        RandomPlayStrategy random(RandomMode::UNIFORM, 42);
+        run("RandomPlayStrategy::getNextSong", random);
+        RandomPlayStrategy shuffle(RandomMode::SHUFFLE, 42);
+        run("RandomPlayStrategy(SHUFFLE)::getNextSong", shuffle);
+        CustomQueueStrategy custom;
+        vector<size_t> queue(n);
+        iota(queue.rbegin(), queue.rend(), size_t(0));
+        custom.setQueue(move(queue));
+        run("CustomQueueStrategy::getNextSong", custom);
+        CustomQueueStrategy radio;
+        radio.setGenerator([n, next = size_t(0)]() mutable -> optional<size_t> {
+            size_t idx = next;
+            if (++next == n) next = 0;
+            return idx;
+        });
+        run("CustomQueueStrategy(gen)::getNextSong", radio);
+        SmartShuffleStrategy smart(42);
+        run("SmartShuffleStrategy::getNextSong", smart);
+    }
+}
+
+void playlistEdits(size_t maxSize) {
+    for (size_t n : playlistSizes(maxSize)) {
+        SongCatalog catalog;
+        Playlist seed(catalog);
+        fillPlaylist(catalog, seed, 0);
+        report("Playlist::addSong", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) {
+                Playlist playlist(catalog);
+                for (size_t j = 0; j < n; ++j) playlist.addSong(static_cast<SongId>(j % catalog.size()));
+                sink = playlist.size();
+            }
+        }) / static_cast<double>(n));
+        // Removes from the middle, where SHIFT pays for moving the tail
+        for (RemovalMode mode : {RemovalMode::SHIFT, RemovalMode::TOMBSTONE}) {
+            size_t removals = mode == RemovalMode::SHIFT ? min(n / 2, size_t(1000)) : n / 2;
+            if (removals == 0) continue;
+            Playlist playlist(catalog);
+            fillPlaylist(catalog, playlist, n);
+            playlist.setRemovalMode(mode);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < removals; ++i) playlist.removeSong(n / 4 + i);
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            report(mode == RemovalMode::SHIFT ? "Playlist::removeSong (SHIFT)" : "Playlist::removeSong (TOMBSTONE)",
+                   n, ns / static_cast<double>(removals));
+        }
+    }
+}
+
+void engine(size_t maxSize) {
+    for (size_t n : playlistSizes(maxSize)) {
+        SongCatalog catalog;
+        Playlist playlist(catalog);
+        fillPlaylist(catalog, playlist, n);
+        NullOutputDevice device;
+        SequentialPlayStrategy strategy;
+        AudioEngine audio;
+        audio.loadPlaylist(playlist);
+        audio.setStrategy(&strategy);
+        audio.setDevice(&device);
+        report("AudioEngine::playNext (null device)", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) audio.playNext();
+        }));
+        audio.setCursorFastPath(false);
+        report("AudioEngine::playNext (no cursor)", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) audio.playNext();
+        }));
+        audio.setCursorFastPath(true);
+        report("AudioEngine::playMultiple (null device)", n, nsPerOp([&](size_t iters) {
+            audio.playMultiple(iters);
+        }));
+        DeviceGroup group;
+        for (int i = 0; i < 4; ++i) group.addTarget(make_unique<NullOutputDevice>());
+        audio.setDevice(&group);
+        report("AudioEngine::playMultiple (group of 4)", n, nsPerOp([&](size_t iters) {
+            audio.playMultiple(iters);
+            group.flush();
+        }));
+        audio.setDevice(&device);
+        audio.setLookahead(8);
+        report("AudioEngine::playNext (lookahead 8)", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) audio.playNext();
+        }));
+        audio.setLookahead(0);
+        sink = device.getPlayed();
+        StaticAudioEngine<SequentialPlayStrategy, NullOutputDevice> fixed;
+        fixed.loadPlaylist(playlist);
+        report("StaticAudioEngine::playNext (null device)", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) fixed.playNext();
+        }));
+        sink = fixed.getDevice().getPlayed();
+    }
+}
+
+void scans(size_t maxSize) {
+    for (size_t n : playlistSizes(maxSize)) {
+        SongCatalog catalog;
+        Playlist playlist(catalog);
+        fillPlaylist(catalog, playlist, n);
+        SongColumns columns(playlist);
+        report("Playlist artist scan (strings)", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) {
+                size_t hits = 0;
+                for (Song s : playlist) hits += s.artist == "Artist 7";
+                sink = hits;
+            }
+        }) / static_cast<double>(n));
+        report("SongColumns::countByArtist", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) sink = columns.countByArtist("Artist 7");
+        }) / static_cast<double>(n));
+    }
+}
+
+// Distinct songs per size (the index is per catalog entry); capped at 1M
+void searches(size_t maxSize) {
+    const char* words[] = {"love", "night", "dance", "blue", "fire", "heart", "light", "road", "dream", "rain"};
+    for (size_t n : playlistSizes(min<size_t>(maxSize, 1'000'000))) {
+        SongCatalog catalog;
+        for (size_t i = 0; i < n; ++i)
+            catalog.addSong(string(words[i % 10]) + " " + words[(i / 10) % 10] + " " + to_string(i),
+                            "Artist " + to_string(i % 997));
+        SearchIndex index(catalog);
+        report("SearchIndex::prefix", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) sink = index.prefix("dre ni", 10).size();
+        }));
+        report("SearchIndex::substring", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) sink = index.substring("art 42", 10).size();
+        }));
+        report("SearchIndex::fuzzy", n, nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) sink = index.fuzzy("fier haert 7", 10).size();
+        }));
+    }
+}
+
+// Hits on a small hot set, then misses on a cache too small for the key space
+void chunkCache() {
+    constexpr size_t CHUNK = 4096;
+    ChunkCache cache(64 * CHUNK * 16, simulatedBackend(CHUNK));
+    for (uint32_t c = 0; c < 64; ++c) cache.get(1, c);
+    report("ChunkCache::get (hit)", 64, nsPerOp([&](size_t iters) {
+        for (size_t i = 0; i < iters; ++i) sink = cache.get(1, static_cast<uint32_t>(i & 63))->size();
+    }));
+    ChunkCache small(16 * CHUNK * 16, simulatedBackend(CHUNK));
+    report("ChunkCache::get (miss, evicting)", 16 * 16, nsPerOp([&](size_t iters) {
+        for (size_t i = 0; i < iters; ++i) sink = small.get(static_cast<SongId>(i), 0)->size();
+    }));
+}
+
+// Per sample for the kernels (over one song's worth of samples), per output
+// frame for whole songs
+void pcm() {
+    constexpr size_t N = PcmOutputDevice::DEFAULT_SONG_FRAMES;
+    vector<float> a(N, 0.25f), b(N, 0.5f), out(3 * N);
+    report("dsp::applyGain", N, nsPerOp([&](size_t iters) {
+        for (size_t i = 0; i < iters; ++i) dsp::applyGain(a.data(), N, 1.0f, 0.0f);
+    }) / N);
+    report("dsp::crossfade", N, nsPerOp([&](size_t iters) {
+        for (size_t i = 0; i < iters; ++i) dsp::crossfade(a.data(), a.data(), b.data(), N, 0.0f, 1.0f / N);
+    }) / N);
+    report("dsp::resampleLinear (to 96k)", N, nsPerOp([&](size_t iters) {
+        for (size_t i = 0; i < iters; ++i) {
+            double pos = 0;
+            sink = dsp::resampleLinear(a.data(), N, pos, 44'100.0 / 96'000, out.data(), out.size());
+        }
+    }) / (N * 96'000.0 / 44'100));
+    SongCatalog catalog;
+    Song song = catalog.get(catalog.addSong("Title", "Artist"));
+    for (DeviceType type : {DeviceType::HEADPHONES, DeviceType::BLUETOOTH, DeviceType::WIRED}) {
+        AudioBlockPool pool(3);
+        MeterSink meter;
+        AudioPipeline pipeline(pool, meter, sampleRateFor(type));
+        double ns = nsPerOp([&](size_t iters) {
+            for (size_t i = 0; i < iters; ++i) pipeline.render(song, PcmOutputDevice::DEFAULT_SONG_FRAMES);
+        });
+        report("AudioPipeline::render @" + to_string(sampleRateFor(type)), PcmOutputDevice::DEFAULT_SONG_FRAMES,
+               ns / (PcmOutputDevice::DEFAULT_SONG_FRAMES * static_cast<double>(sampleRateFor(type)) / SOURCE_SAMPLE_RATE));
+    }
+}
+
+// One worker against all of them, per element, to show scaling with cores
+void bulkOps(size_t maxSize) {
+    WorkStealingPool single(1), all;
+    for (size_t n : playlistSizes(maxSize)) {
+        if (n < 10'000) continue;
+        SongCatalog catalog;
+        Playlist playlist(catalog);
+        fillPlaylist(catalog, playlist, n);
+        for (WorkStealingPool* pool : {&single, &all}) {
+            string suffix = " x" + to_string(pool->workerCount());
+            report("bulk::sortedSlots" + suffix, n, nsPerOp([&](size_t iters) {
+                for (size_t i = 0; i < iters; ++i) sink = bulk::sortedSlots(*pool, playlist, bulk::SortKey::ARTIST_TITLE).size();
+            }) / static_cast<double>(n));
+            report("bulk::dedupe" + suffix, n, nsPerOp([&](size_t iters) {
+                for (size_t i = 0; i < iters; ++i) sink = bulk::dedupe(*pool, playlist).size();
+            }) / static_cast<double>(n));
+        }
+    }
+}
+
+void run(size_t maxSize) {
+    cout << left << setw(40) << "benchmark" << right << setw(12) << "playlist" << setw(12) << "time" << "\n";
+    strategies(maxSize);
+    playlistEdits(maxSize);
+    engine(maxSize);
+    scans(maxSize);
+    searches(maxSize);
+    bulkOps(maxSize);
+    pcm();
+    chunkCache();
+}
+}  // namespace bench
+
+// Self tests (run with --self-test): regression checks for behaviour the demo
+// does not reach. A failed check throws and the run exits non-zero.
+namespace selftest {
+inline void check(bool ok, const char* what) {
+    if (!ok) throw runtime_error(string("check failed: ") + what);
+}
+
+// Songs cannot be built from temporary strings, whose text would dangle at once
+static_assert(!is_constructible_v<Song, string, string_view>, "Song rejects a temporary title");
+static_assert(!is_constructible_v<Song, string_view, string>, "Song rejects a temporary artist");
+static_assert(!is_constructible_v<Song, string>, "Song rejects a temporary title alone");
+static_assert(is_constructible_v<Song, const string&, const char*>, "Song accepts caller-owned text");
+
+// Over-aligned devices must land on their own alignment in the object pool
+void pooledAlignment() {
+    check(alignof(AsyncOutputDevice) > alignof(max_align_t), "AsyncOutputDevice is over-aligned");
+    vector<unique_ptr<IAudioOutputDevice>> devices;
+    for (int i = 0; i < 8; ++i) {
+        devices.push_back(make_unique<AsyncOutputDevice>(make_unique<NullOutputDevice>()));
+        check(reinterpret_cast<uintptr_t>(devices.back().get()) % alignof(AsyncOutputDevice) == 0,
+              "AsyncOutputDevice is aligned");
+    }
+}
+
+// Discards everything, so tests can drive the printing adapters quietly
+struct NullBuffer : streambuf {
+    int overflow(int c) override { return c; }
+};
+// Redirects cout for the lifetime of the guard
+class QuietCout {
+    NullBuffer buffer;
+    streambuf* saved = cout.rdbuf(&buffer);
+public:
+    ~QuietCout() { cout.rdbuf(saved); }
+};
+
+inline string tempPath(string_view name) {
+    return "/tmp/spotify-selftest-" + to_string(getpid()) + "-" + string(name);
+}
+
+// By default a full queue drops rather than stalls the producer, and the
+// sleep/wake handshake never loses a song pushed as the I/O thread dozes off
+void asyncDeviceNeverBlocks() {
+    struct GatedDevice final : IAudioOutputDevice {
+        shared_future<void> gate;
+        atomic<size_t> played{0};
+        explicit GatedDevice(shared_future<void> g) : gate(move(g)) {}
+        void playSound(const Song&) override { gate.wait(); ++played; }
+        void playBatch(span<const Song> songs) override { gate.wait(); played += songs.size(); }
+    };
+    promise<void> open;
+    auto inner = make_unique<GatedDevice>(open.get_future().share());
+    GatedDevice* gated = inner.get();
+    AsyncOutputDevice device(move(inner), 16);
+    Song song("Song", "Artist", 0);
+    for (int i = 0; i < 200; ++i) device.playSound(song);   // would spin forever under BLOCK
+    OutputQueueStats st = device.getStats();
+    check(st.dropped > 0 && st.enqueued + st.dropped == 200 && st.stalls == 0, "a full queue drops by default");
+    open.set_value();
+    device.flush();
+    for (int i = 0; i < 20'000; ++i) {
+        device.playSound(song);
+        device.flush();
+    }
+    check(gated->played == device.getStats().enqueued, "every queued song reaches the device");
+}
+
+// Prefix, substring and fuzzy lookups each find their song, search() ranks it
+// first, and a query matching nothing returns nothing
+void searchQueries() {
+    SongCatalog catalog;
+    const pair<const char*, const char*> songs[] = {
+        {"Lose Yourself", "Eminem"}, {"Bohemian Rhapsody", "Queen"}, {"Blinding Lights", "The Weeknd"},
+        {"Imagine", "John Lennon"}, {"Bodysnatchers", "Radiohead"}, {"Another One Bites the Dust", "Queen"},
+    };
+    for (const auto& [t, a] : songs) catalog.addSong(t, a);
+    SearchIndex index(catalog);
+    auto top = [&](const vector<SearchHit>& hits) { return hits.empty() ? string() : string(catalog.get(hits[0].id).title); };
+
+    check(top(index.prefix("boh", 5)) == "Bohemian Rhapsody", "prefix \"boh\"");
+    check(index.prefix("boh", 5).size() == 1, "prefix \"boh\" is not \"bod\"");
+    check(top(index.prefix("rhaps", 5)) == "Bohemian Rhapsody", "prefix \"rhaps\"");
+    check(index.prefix("ody que", 5).empty(), "\"ody que\" prefixes no words");
+    vector<SearchHit> inner = index.substring("ody que", 5);
+    check(inner.size() == 1 && top(inner) == "Bohemian Rhapsody", "substring \"ody que\" spans title and artist");
+    check(top(index.fuzzy("blindng lihgts", 5)) == "Blinding Lights", "fuzzy \"blindng lihgts\"");
+
+    for (const char* query : {"boh", "rhaps", "ody que"})
+        check(top(index.search(query, 3)) == "Bohemian Rhapsody", "search ranks the match first");
+    check(top(index.search("blindng lihgts", 3)) == "Blinding Lights", "search falls through to fuzzy");
+    check(index.search("xqzvw jjkk", 3).empty(), "a query matching nothing returns nothing");
+}
+
+// Output runs at the target rate, muting ramps down to exact silence within a
+// block, and the compiled kernels (SIMD under -mavx2 / NEON) match plain loops
+void audioPipeline() {
+    struct PeakSink final : PcmSink {
+        vector<float> peaks;
+        uint64_t frames = 0;
+        void write(const AudioBlock& block) override {
+            float peak = 0;
+            for (size_t c = 0; c < AudioBlock::CHANNELS; ++c)
+                for (size_t i = 0; i < block.frames; ++i) peak = max(peak, fabs(block.samples[c][i]));
+            peaks.push_back(peak);
+            frames += block.frames;
+        }
+    };
+    AudioBlockPool pool(3);
+    Song song("Tone", "Artist", 5);
+    for (uint32_t rate : {48'000u, 96'000u}) {
+        PeakSink sink;
+        AudioPipeline pipeline(pool, sink, rate);
+        pipeline.render(song, SOURCE_SAMPLE_RATE);   // one second
+        pipeline.finish();
+        check(sink.frames + 2 >= rate && sink.frames <= rate, "one second of source plays as one second at the target rate");
+        check(pipeline.getFramesOut() == sink.frames, "every output frame reaches the sink");
+    }
+    {
+        PeakSink sink;
+        AudioPipeline pipeline(pool, sink, SOURCE_SAMPLE_RATE);
+        pipeline.setVolume(0);
+        pipeline.render(song, 16 * AudioBlock::FRAMES);
+        pipeline.finish();
+        check(sink.peaks.size() > 2 && sink.peaks[0] > 0, "a mute ramps down rather than cutting off");
+        for (size_t b = 1; b < sink.peaks.size(); ++b) check(sink.peaks[b] == 0, "a mute reaches silence after one block");
+    }
+
+    constexpr size_t N = 1003;   // not a multiple of any lane count, so the scalar tail runs too
+    vector<float> a(N + 1), b(N), x(N), ref(N);
+    for (size_t i = 0; i <= N; ++i) a[i] = static_cast<float>(sin(0.01 * double(i)));
+    for (size_t i = 0; i < N; ++i) b[i] = static_cast<float>(cos(0.02 * double(i)));
+    auto near = [&](const float* got, size_t n, float tolerance) {
+        for (size_t i = 0; i < n; ++i) if (fabs(got[i] - ref[i]) > tolerance) return false;
+        return true;
+    };
+    const float from = 1.0f, step = -1.0f / N;
+    copy_n(a.begin(), N, x.begin());
+    dsp::applyGain(x.data(), N, from, step);
+    for (size_t i = 0; i < N; ++i) ref[i] = a[i] * (from + static_cast<float>(i) * step);
+    check(near(x.data(), N, 1e-5f), "applyGain matches the scalar ramp");
+    dsp::crossfade(x.data(), a.data(), b.data(), N, 0.0f, 1.0f / N);
+    for (size_t i = 0; i < N; ++i) ref[i] = a[i] + (static_cast<float>(i) / N) * (b[i] - a[i]);
+    check(near(x.data(), N, 1e-5f), "crossfade matches the scalar blend");
+    double pos = 0, rstep = 44'100.0 / 48'000.0;
+    size_t written = dsp::resampleLinear(a.data(), N + 1, pos, rstep, x.data(), N);
+    for (size_t w = 0; w < written; ++w) {
+        double p = double(w) * rstep;
+        size_t i = static_cast<size_t>(p);
+        ref[w] = a[i] + static_cast<float>(p - double(i)) * (a[i + 1] - a[i]);
+    }
+    check(written == N || pos >= double(N), "resampleLinear fills the output or consumes the input");
+    check(near(x.data(), written, 1e-3f), "resampleLinear matches scalar interpolation");
+}
+
+// Devices switch from this thread while another plays; run under TSan to see
+// the race-freedom half of this. Afterwards plays are logged as the last device.
+void switchDeviceWhilePlaying() {
+    string path = tempPath("switch.log");
+    {
+        QuietCout quiet;
+        PlayEventLog log(path);
+        MusicPlayerFacade player;
+        player.prewarmDevices({DeviceType::BLUETOOTH, DeviceType::WIRED, DeviceType::HEADPHONES});
+        for (int i = 0; i < 8; ++i) {
+            string title = "Song " + to_string(i);
+            player.addSongToPlaylist(Song(title, "Artist"));
+        }
+        player.configure(DeviceType::BLUETOOTH, PlayStrategyType::SEQUENTIAL);
+        player.setEventLog(&log);
+        atomic<bool> stop{false};
+        thread listener([&] {
+            while (!stop.load(memory_order_relaxed)) player.playMultiple(4);
+        });
+        constexpr DeviceType order[] = {DeviceType::WIRED, DeviceType::HEADPHONES, DeviceType::BLUETOOTH};
+        for (int i = 0; i < 300; ++i) player.switchDevice(order[i % 3]);
+        player.switchDevice(DeviceType::HEADPHONES);
+        stop.store(true, memory_order_relaxed);
+        listener.join();
+        player.playNext();
+        log.flush();
+        vector<PlayEvent> events = PlayEventLog::read(path);
+        check(!events.empty(), "plays were logged");
+        check(events.back().device == DeviceType::HEADPHONES, "plays after the switch are logged as the new device");
+    }
+    remove(path.c_str());
+}
+
+// Two threads race to swap in (device, type) pairs; every play must be logged
+// with the type that was published alongside the device that played it
+void overlappingDeviceSwaps() {
+    struct TaggingDevice final : IAudioOutputDevice {
+        DeviceType type;
+        vector<DeviceType>* played;
+        TaggingDevice(DeviceType t, vector<DeviceType>* out) : type(t), played(out) {}
+        void playSound(const Song&) override { played->push_back(type); }
+    };
+    string path = tempPath("swaps.log");
+    {
+        SongCatalog catalog;
+        Playlist playlist(catalog);
+        for (int i = 0; i < 8; ++i) playlist.addSong(catalog.addSong("Song " + to_string(i), "Artist"));
+        vector<DeviceType> played;
+        TaggingDevice wired(DeviceType::WIRED, &played), headphones(DeviceType::HEADPHONES, &played);
+        SequentialPlayStrategy strategy;
+        PlayEventLog log(path);
+        AudioEngine engine;
+        engine.setDevice(&wired);
+        engine.setStrategy(&strategy);
+        engine.loadPlaylist(playlist);
+        engine.setEventLog(&log, 1, DeviceType::WIRED);
+        atomic<bool> stop{false};
+        auto swapper = [&](TaggingDevice* dev) {
+            while (!stop.load(memory_order_relaxed)) engine.swapDevice(dev, dev->type);
+        };
+        thread a(swapper, &wired), b(swapper, &headphones);
+        for (int i = 0; i < 20'000; ++i) engine.playNext();
+        stop.store(true, memory_order_relaxed);
+        a.join();
+        b.join();
+        log.flush();
+        vector<PlayEvent> events = PlayEventLog::read(path);
+        check(events.size() == played.size(), "every play is logged");
+        for (size_t i = 0; i < events.size(); ++i)
+            check(events[i].device == played[i], "the logged type is the playing device's");
+    }
+    remove(path.c_str());
+}
+
+// Feedback given before any pick must count, and scores follow the song, not
+// its slot, when a SHIFT removal moves the later songs down
+void smartShuffleFeedback() {
+    SongCatalog catalog;
+    Playlist playlist(catalog);
+    vector<SongId> ids;
+    for (int i = 0; i < 4; ++i) ids.push_back(catalog.addSong("Song " + to_string(i), "Artist"));
+    for (SongId id : ids) playlist.addSong(id);
+    SmartShuffleStrategy strategy(7);
+    for (int i = 0; i < 5; ++i) strategy.onReplay(ids[0]);
+    check(strategy.getScore(ids[0]) == 1024 * 32, "replays before the first pick are kept");
+    size_t boosted = 0;
+    for (int i = 0; i < 1000; ++i) boosted += strategy.getNextSong(playlist).id == ids[0];
+    check(boosted > 500, "a boosted song is picked most often");
+
+    strategy.onSkip(catalog.get(ids[2]));
+    playlist.removeSong(0);   // SHIFT: ids[1..3] move to slots 0..2
+    strategy.getNextSong(playlist);
+    check(strategy.getScore(ids[1]) == 1024, "a shifted song keeps its own score");
+    check(strategy.getScore(ids[2]) == 512, "a skipped song keeps its penalty after the shift");
+    for (int i = 0; i < 1000; ++i) check(strategy.getNextSong(playlist).id != ids[0], "removed songs are not picked");
+}
+
+// The queue is validated when set; later removals make entries stale, and
+// playback skips them and falls back to playlist order instead of throwing
+void customQueueSurvivesRemovals() {
+    SongCatalog catalog;
+    Playlist playlist(catalog);
+    for (int i = 0; i < 6; ++i) playlist.addSong(catalog.addSong("Song " + to_string(i), "Artist"));
+    CustomQueueStrategy strategy;
+    strategy.setQueue({5, 1, 3}, playlist);
+    bool rejected = false;
+    try { strategy.setQueue({1, 9}, playlist); } catch (const runtime_error&) { rejected = true; }
+    check(rejected, "an out-of-range queue is rejected when set");
+    check(strategy.getNextSong(playlist).title == "Song 5", "a rejected queue keeps the previous one");
+
+    playlist.removeSong(5);   // SHIFT: the playlist shrinks below queue entry 5
+    check(strategy.getNextSong(playlist).title == "Song 1", "playback goes on after a removal");
+    check(strategy.getNextSong(playlist).title == "Song 3", "playback goes on after a removal");
+    check(strategy.getNextSong(playlist).title == "Song 1", "an out-of-range entry is skipped");
+    playlist.setRemovalMode(RemovalMode::TOMBSTONE);
+    playlist.removeSong(1);
+    check(strategy.getNextSong(playlist).title == "Song 3", "a removed entry is skipped");
+    check(strategy.getNextSong(playlist).title == "Song 3", "a removed entry is skipped");
+    playlist.removeSong(3);
+    SongId ids[4];
+    check(strategy.fillNext(playlist, ids) == 4, "playback continues with no playable entry left");
+    check(catalog.get(ids[0]).title == "Song 0" && catalog.get(ids[1]).title == "Song 2" &&
+          catalog.get(ids[3]).title == "Song 0", "it falls back to playlist order");
+
+    CustomQueueStrategy radio;
+    radio.setGenerator([n = 0]() mutable -> optional<size_t> { return n < 2 ? optional<size_t>(n++ * 100) : nullopt; });
+    check(radio.getNextSong(playlist).title == "Song 0", "out-of-range and exhausted generators fall back too");
+}
+
+// Tombstone removals are point updates on the tree: no rebuild, and removed
+// slots are never picked. Compaction is what rebuilds.
+void smartShuffleTombstones() {
+    SongCatalog catalog;
+    Playlist playlist(catalog);
+    playlist.setRemovalMode(RemovalMode::TOMBSTONE);
+    for (int i = 0; i < 1000; ++i) playlist.addSong(catalog.addSong("Song " + to_string(i), "Artist"));
+    SmartShuffleStrategy strategy(11);
+    strategy.getNextSong(playlist);
+    for (size_t slot = 0; slot < 1000; slot += 2) {
+        playlist.removeSong(slot);
+        for (int i = 0; i < 4; ++i) {
+            SongId id = strategy.getNextSong(playlist).id;   // slot i holds song i
+            check(id % 2 == 1 || id > slot, "removed slots are never picked");
+        }
+    }
+    check(strategy.rebuildCount() == 1, "tombstones do not rebuild the weights");
+    playlist.compact();
+    strategy.getNextSong(playlist);
+    check(strategy.rebuildCount() == 2, "compaction rebuilds them");
+}
+
+// Sorting and dedupe agree with a sequential reference both when the catalog is
+// small next to the playlist (dense tables) and when it is far larger (sparse)
+void bulkOpsMatchReference() {
+    WorkStealingPool pool(2);
+    atomic<size_t> calls{0};
+    vector<size_t> odd = bulk::parallelSelect(pool, 100'000, [&](size_t i) { ++calls; return i % 2 == 1; });
+    check(calls == 100'000 && odd.size() == 50'000 && odd[1] == 3, "parallelSelect calls keep once per index");
+
+    for (size_t catalogSize : {50, 200'000}) {
+        SongCatalog catalog;
+        for (size_t i = 0; i < catalogSize; ++i)
+            catalog.addSong("Title " + to_string((i * 7919) % catalogSize), "Artist " + to_string(i % 13));
+        Playlist playlist(catalog);
+        playlist.setRemovalMode(RemovalMode::TOMBSTONE);
+        Xoshiro256 rng(catalogSize);
+        for (int i = 0; i < 500; ++i) playlist.addSong(static_cast<SongId>(rng.below(min<size_t>(catalogSize, 400))));
+        for (int i = 0; i < 50; ++i) playlist.removeSong(static_cast<size_t>(rng.below(500)));
+
+        span<const SongId> slots = playlist.getSongs();
+        vector<size_t> expected;
+        for (size_t i = 0; i < slots.size(); ++i) if (slots[i] != INVALID_SONG_ID) expected.push_back(i);
+        stable_sort(expected.begin(), expected.end(), [&](size_t a, size_t b) {
+            Song x = catalog.get(slots[a]), y = catalog.get(slots[b]);
+            return tie(x.artist, x.title) < tie(y.artist, y.title);
+        });
+        check(bulk::sortedSlots(pool, playlist, bulk::SortKey::ARTIST_TITLE) == expected, "sortedSlots matches stable_sort");
+
+        vector<SongId> firsts;
+        unordered_map<SongId, bool> seen;
+        for (SongId id : slots) if (id != INVALID_SONG_ID && !seen[id]) { seen[id] = true; firsts.push_back(id); }
+        Playlist unique = bulk::dedupe(pool, playlist);
+        check(vector<SongId>(unique.getSongs().begin(), unique.getSongs().end()) == firsts, "dedupe keeps first occurrences");
+    }
+}
+
+// Events appended from several threads, with wide timestamps, large ids and
+// every device, decode back field by field (the per-block sort is by time)
+void eventLogRoundTrip() {
+    string path = tempPath("roundtrip.log");
+    constexpr uint32_t THREADS = 4, PER_THREAD = 5000;
+    auto event = [](uint32_t t, uint32_t i) {
+        uint32_t n = t * PER_THREAD + i;
+        return PlayEvent{1'700'000'000'000'000'000ull + uint64_t(n) * 1'000'003, t * 1'000'000 + i,
+                         SongId(n % 3 == 0 ? INVALID_SONG_ID - 1 - n : n * 7), static_cast<DeviceType>(n % 3)};
+    };
+    {
+        PlayEventLog log(path);
+        vector<thread> writers;
+        for (uint32_t t = 0; t < THREADS; ++t)
+            writers.emplace_back([&, t] {
+                for (uint32_t i = 0; i < PER_THREAD; i += 10) {
+                    PlayEvent batch[10];
+                    for (uint32_t j = 0; j < 10; ++j) batch[j] = event(t, i + j);
+                    log.append(span<const PlayEvent>(batch, 10));
+                }
+            });
+        for (thread& w : writers) w.join();
+        log.flush();
+        check(log.committedEvents() == THREADS * PER_THREAD, "every appended event is committed");
+    }
+    vector<PlayEvent> events = PlayEventLog::read(path);
+    check(events.size() == THREADS * PER_THREAD, "every event is read back");
+    sort(events.begin(), events.end(), [](const PlayEvent& a, const PlayEvent& b) { return a.timestampNs < b.timestampNs; });
+    for (uint32_t n = 0; n < events.size(); ++n) {
+        PlayEvent want = event(n / PER_THREAD, n % PER_THREAD);
+        const PlayEvent& got = events[n];
+        check(got.timestampNs == want.timestampNs && got.session == want.session && got.song == want.song &&
+              got.device == want.device, "events decode field by field");
+    }
+    remove(path.c_str());
+}
+
+// A thread alternating between two logs keeps one buffer per log, and every
+// event still reaches the log it was appended to
+void alternatingEventLogs() {
+    string pathA = tempPath("a.log"), pathB = tempPath("b.log");
+    {
+        PlayEventLog a(pathA), b(pathB);
+        for (uint32_t i = 0; i < 5000; ++i) {
+            a.append(PlayEvent{1000 + i, 1, SongId(i), DeviceType::WIRED});
+            b.append(PlayEvent{1000 + i, 2, SongId(i * 2), DeviceType::BLUETOOTH});
+        }
+        check(a.threadBuffers() == 1 && b.threadBuffers() == 1, "one buffer per (thread, log)");
+        thread other([&] { a.append(PlayEvent{1, 3, 0, DeviceType::HEADPHONES}); });
+        other.join();
+        check(a.threadBuffers() == 2, "another thread gets its own buffer");
+        a.flush();
+        b.flush();
+        check(PlayEventLog::read(pathA).size() == 5001, "events reach the first log");
+        vector<PlayEvent> second = PlayEventLog::read(pathB);
+        check(second.size() == 5000 && second.back().song == SongId(9998) && second.back().session == 2,
+              "events reach the second log");
+    }
+    remove(pathA.c_str());
+    remove(pathB.c_str());
+}
+
+// Misses fetch outside the service lock while another client keeps editing;
+// once the edits stop, no stale snapshot may be left in the cache
+void shardedViewsStayFresh() {
+    SongCatalog catalog;
+    SongId song = catalog.addSong("Song", "Artist");
+    PlaylistCluster cluster(catalog, 4);
+    ShardedPlaylistService service(cluster, 4);
+    constexpr PlaylistId PLAYLISTS = 16;
+    constexpr size_t EDITS = 200;
+    atomic<bool> stop{false};
+    vector<thread> readers;
+    for (int r = 0; r < 3; ++r)
+        readers.emplace_back([&, r] {
+            for (PlaylistId id = r; !stop.load(memory_order_relaxed); id = (id + 1) % PLAYLISTS) service.view(id);
+        });
+    PlaylistMutation add{PlaylistMutation::Kind::ADD, song, 0};
+    for (size_t i = 0; i < EDITS; ++i)
+        for (PlaylistId id = 0; id < PLAYLISTS; ++id) cluster.apply(id, span<const PlaylistMutation>(&add, 1));
+    stop.store(true, memory_order_relaxed);
+    for (thread& t : readers) t.join();
+    for (PlaylistId id = 0; id < PLAYLISTS; ++id)
+        check(service.view(id)->size() == EDITS, "views show the latest version once edits stop");
+}
+
+// Concurrent misses on one chunk share a single load, and a stream of distinct
+// chunks never takes the cache past its byte budget
+void chunkCacheLoadsAndBudget() {
+    mutex m;
+    unordered_map<uint64_t, int> loads;   // (song << 32 | chunk) -> loads
+    ChunkLoader slowLoader = [&](SongId song, uint32_t chunk) {
+        {
+            lock_guard<mutex> lk(m);
+            ++loads[uint64_t(song) << 32 | chunk];
+        }
+        this_thread::sleep_for(chrono::milliseconds(2));   // keeps the misses overlapping
+        return make_shared<const vector<uint8_t>>(1024, uint8_t(chunk));
+    };
+    {
+        ChunkCache cache(1 << 20, slowLoader, 4);
+        constexpr uint32_t KEYS = 32;
+        constexpr int THREADS = 8;
+        vector<thread> readers;
+        for (int t = 0; t < THREADS; ++t)
+            readers.emplace_back([&] {
+                for (uint32_t c = 0; c < KEYS; ++c) check(cache.get(7, c)->front() == uint8_t(c), "get returns its chunk");
+            });
+        for (thread& t : readers) t.join();
+        check(loads.size() == KEYS, "every key is loaded");
+        for (const auto& [key, count] : loads) check(count == 1, "each key is loaded once under concurrent gets");
+        const ChunkCache::Stats& st = cache.getStats();
+        check(st.misses == KEYS && st.hits + st.coalesced + st.misses == uint64_t(KEYS) * THREADS, "every get is counted once");
+    }
+
+    ChunkCache cache(64 << 10, [](SongId, uint32_t chunk) {
+        return make_shared<const vector<uint8_t>>(chunk % 7 == 0 ? 100'000 : 1024 + chunk % 512);
+    });
+    for (uint32_t c = 0; c < 5000; ++c) {
+        cache.get(1, c);
+        check(cache.getStats().bytes <= cache.capacity(), "bytes stay within capacity");
+    }
+    check(cache.getStats().evictions > 0, "the stream forced evictions");
+}
+
+// A cache's gauges report while it lives and are gone once it is destroyed
+void cacheGaugesUnregister() {
+    auto gaugeNamed = [](const string& name) -> optional<uint64_t> {
+        for (const auto& [n, v] : metrics::Registry::instance().readGauges()) if (n == name) return v;
+        return nullopt;
+    };
+    {
+        ChunkCache cache(1 << 20, [](SongId, uint32_t) { return make_shared<const vector<uint8_t>>(16); });
+        cache.registerGauges("selftest_cache");
+        cache.get(1, 0);
+        cache.get(1, 0);
+        check(gaugeNamed("selftest_cache.hits") == 1u, "gauges read the live cache");
+    }
+    check(!gaugeNamed("selftest_cache.hits"), "gauges are removed with the cache");
+}
+
+// A well-formed catalog file maps; truncated copies and ones with a corrupted
+// header, text ref, song record, playlist range or entry are all rejected
+void corruptCatalogRejected() {
+    SongCatalog catalog;
+    Playlist first(catalog), second(catalog);
+    for (int i = 0; i < 20; ++i) first.addSong(catalog.addSong("Title " + to_string(i), "Artist " + to_string(i % 3)));
+    second.addSong(3);
+    string path = tempPath("catalog.bin");
+    const Playlist* lists[] = {&first, &second};
+    CatalogFile::write(path, catalog, lists);
+    string good;
+    {
+        ifstream in(path, ios::binary);
+        good.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    {
+        MappedCatalog mapped(path);
+        check(mapped.playlistCount() == 2 && mapped.getPlaylist(0).getSong(19).title == "Title 19", "a good file maps");
+    }
+    CatalogFileHeader h;
+    memcpy(&h, good.data(), sizeof(h));
+    CatalogFile::Layout l = CatalogFile::layout(h);
+    auto rejects = [&](const string& bytes) {
+        {
+            ofstream out(path, ios::binary | ios::trunc);
+            out.write(bytes.data(), static_cast<streamsize>(bytes.size()));
+        }
+        try { MappedCatalog mapped(path); } catch (const runtime_error&) { return true; }
+        return false;
+    };
+    auto patched = [&](uint64_t offset, auto value) {
+        string bytes = good;
+        memcpy(bytes.data() + offset, &value, sizeof(value));
+        return bytes;
+    };
+    for (size_t cut : {size_t(0), size_t(16), sizeof(h), size_t(l.songs), good.size() - 8})
+        check(rejects(good.substr(0, cut)), "a truncated file is rejected");
+    check(rejects(patched(offsetof(CatalogFileHeader, textCount), uint64_t(1) << 62)), "an overflowing text count is rejected");
+    check(rejects(patched(offsetof(CatalogFileHeader, entryCount), ~uint64_t(0))), "an overflowing entry count is rejected");
+    check(rejects(patched(l.texts, SongCatalog::TextRef{0xFFFFFFF0u, 64})), "a text ref past the blob is rejected");
+    check(rejects(patched(l.songs, SongCatalog::SongRecord{0, 1'000'000})), "a song record past the text table is rejected");
+    check(rejects(patched(l.playlists, CatalogPlaylistRef{~uint64_t(0), 2})), "a wrapping playlist range is rejected");
+    check(rejects(patched(l.entries, SongId(1'000'000))), "an entry past the song table is rejected");
+    remove(path.c_str());
+}
+
+// Every format round-trips awkward text, and a headerless CSV keeps a first
+// record that happens to read "title,artist"
+void playlistRoundTrip() {
+    SongCatalog catalog;
+    Playlist playlist(catalog);
+    const pair<const char*, const char*> songs[] = {
+        {"title", "artist"}, {"Comma, \"Quoted\"", "Line\nBreak"}, {"Tab\tand \\", "Ünïcode"}, {"Plain", "Artist"},
+    };
+    for (const auto& [t, a] : songs) playlist.addSong(catalog.addSong(t, a));
+    for (PlaylistFormat format : {PlaylistFormat::CSV, PlaylistFormat::CSV_HEADER, PlaylistFormat::JSONL, PlaylistFormat::BINARY}) {
+        string path = tempPath("roundtrip-" + to_string(static_cast<int>(format)));
+        check(PlaylistWriter::exportTo(path, format, playlist) == size(songs), "every song is exported");
+        SongCatalog readCatalog;
+        Playlist read(readCatalog);
+        check(PlaylistReader::import(path, format, readCatalog, read) == size(songs), "every song is imported");
+        size_t i = 0;
+        for (Song s : read) {
+            check(s.title == songs[i].first && s.artist == songs[i].second, "imported songs match the exported ones");
+            ++i;
+        }
+        remove(path.c_str());
+    }
+}
+
+// Batched appends grow the storage geometrically, so a large import is linear
+void largeImport() {
+    SongCatalog catalog;
+    Playlist playlist(catalog);
+    vector<SongId> batch(PlaylistReader::BATCH_SONGS, catalog.addSong("Song", "Artist"));
+    size_t reallocations = 0;
+    const SongId* data = nullptr;
+    for (int i = 0; i < 1000; ++i) {
+        playlist.addSongs(batch);
+        if (playlist.getSongs().data() != data) { ++reallocations; data = playlist.getSongs().data(); }
+    }
+    check(playlist.size() == 1000 * PlaylistReader::BATCH_SONGS, "every batch is appended");
+    check(reallocations < 40, "appends reallocate a logarithmic number of times");
+
+    string path = tempPath("large.csv");
+    {
+        ofstream out(path, ios::binary);
+        for (int i = 0; i < 1'000'000; ++i) out << "Song " << i % 1000 << ",Artist\n";
+    }
+    Playlist imported(catalog);
+    check(PlaylistReader::import(path, PlaylistFormat::CSV, catalog, imported) == 1'000'000, "a large CSV imports fully");
+    check(imported.size() == 1'000'000 && imported.getSong(999'999).title == "Song 999", "the last record lands last");
+    remove(path.c_str());
+}
+
+void run() {
+    const pair<const char*, void (*)()> tests[] = {
+        {"pooled alignment", pooledAlignment},
+        {"async device never blocks", asyncDeviceNeverBlocks},
+        {"search queries", searchQueries},
+        {"audio pipeline", audioPipeline},
+        {"switch device while playing", switchDeviceWhilePlaying},
+        {"overlapping device swaps", overlappingDeviceSwaps},
+        {"smart shuffle feedback", smartShuffleFeedback},
+        {"smart shuffle tombstones", smartShuffleTombstones},
+        {"custom queue survives removals", customQueueSurvivesRemovals},
+        {"bulk ops match reference", bulkOpsMatchReference},
+        {"event log round trip", eventLogRoundTrip},
+        {"alternating event logs", alternatingEventLogs},
+        {"sharded views stay fresh", shardedViewsStayFresh},
+        {"chunk cache loads and budget", chunkCacheLoadsAndBudget},
+        {"cache gauges unregister", cacheGaugesUnregister},
+        {"corrupt catalog rejected", corruptCatalogRejected},
+        {"playlist round trip", playlistRoundTrip},
+        {"large import", largeImport},
+    };
+    for (const auto& [name, test] : tests) {
+        test();
+        cout << "ok   " << name << '\n';
+    }
+}
+}  // namespace selftest
+
+// Load test (run with --load-test [sessions] [playlist size] [plays per session]
+// [device switches per 1000 plays]): many listeners on one SessionManager with
+// a mix of strategies on null devices, some of them switching device mid-play
+namespace loadtest {
+struct Options {
+    size_t sessions = 10'000;
+    size_t playlistSize = 1'000;
+    size_t playsPerSession = 100;
+    size_t switchesPerThousand = 10;
+};
+
+// Resident set size in bytes; 0 where /proc is unavailable
+inline uint64_t residentBytes() {
+    ifstream statm("/proc/self/statm");
+    uint64_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Sequential, uniform random and custom-queue sessions in equal shares
+inline unique_ptr<PlayStrategy> mixedStrategy(size_t session, size_t playlistSize, Xoshiro256& rng) {
+    constexpr size_t QUEUE_LENGTH = 64;
+    switch (session % 3) {
+        case 0: return make_unique<SequentialPlayStrategy>();
+        case 1: return make_unique<RandomPlayStrategy>(RandomMode::UNIFORM, session);
+        default: {
+            vector<size_t> queue(min(QUEUE_LENGTH, playlistSize));
+            for (size_t& idx : queue) idx = rng.below(playlistSize);
+            auto custom = make_unique<CustomQueueStrategy>();
+            custom->setQueue(move(queue));
+            return custom;
+        }
+    }
+}
+
+void run(const Options& opt) {
+    if (opt.sessions == 0 || opt.playlistSize == 0) throw runtime_error("Load test needs sessions and songs");
+    SongCatalog catalog;
+    Playlist playlist(catalog);
+    bench::fillPlaylist(catalog, playlist, opt.playlistSize);
+    uint64_t rssBefore = residentBytes();
+    SessionManager manager(playlist);
+    manager.setTimedPlays(true);
+    Xoshiro256 rng(opt.sessions);
+    for (size_t i = 0; i < opt.sessions; ++i)
+        manager.openSession(make_unique<NullOutputDevice>(), mixedStrategy(i, opt.playlistSize, rng));
+    uint64_t rssOpen = residentBytes();
+
+    // Switches are spread over the queueing loop so they land while sessions play
+    size_t switches = opt.sessions * opt.playsPerSession * opt.switchesPerThousand / 1000, switched = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < opt.sessions; ++i) {
+        manager.play(i, opt.playsPerSession);
+        for (; switched < switches * (i + 1) / opt.sessions; ++switched)
+            manager.switchDevice(rng.below(opt.sessions), make_unique<NullOutputDevice>(), DeviceType::WIRED);
+    }
+    manager.wait();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    metrics::HistogramSnapshot latency = manager.playLatency();
+    size_t failures = 0;
+    for (size_t i = 0; i < opt.sessions; ++i) failures += manager.getSession(i).getFailures();
+    auto line = [](string_view name, auto value) { cout << left << setw(28) << name << right << setw(16) << value << '\n'; };
+    cout << fixed << setprecision(0);
+    line("sessions", opt.sessions);
+    line("workers", manager.workerCount());
+    line("playlist size", opt.playlistSize);
+    line("plays", latency.total());
+    line("device switches", switched);
+    line("failed slices", failures);
+    line("plays/sec", static_cast<double>(latency.total()) / seconds);
+    line("playNext p50 (ns)", latency.percentile(0.5));
+    line("playNext p99 (ns)", latency.percentile(0.99));
+    line("playNext p999 (ns)", latency.percentile(0.999));
+    line("RSS (KiB)", residentBytes() / 1024);
+    line("RSS per session (bytes)", static_cast<double>(rssOpen - min(rssOpen, rssBefore)) / static_cast<double>(opt.sessions));
+}
+}  // namespace loadtest
+
+// main
+int main(int argc, char** argv) {
+    if (argc > 1 && string_view(argv[1]) == "--bench") {
+        bench::run(argc > 2 ? stoull(argv[2]) : 10'000'000);
+        return 0;
+    }
+    if (argc > 1 && string_view(argv[1]) == "--self-test") {
+        try {
+            selftest::run();
+        } catch (const exception& e) {
+            cout << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 1 && string_view(argv[1]) == "--load-test") {
+        loadtest::Options opt;
+        if (argc > 2) opt.sessions = stoull(argv[2]);
+        if (argc > 3) opt.playlistSize = stoull(argv[3]);
+        if (argc > 4) opt.playsPerSession = stoull(argv[4]);
+        if (argc > 5) opt.switchesPerThousand = stoull(argv[5]);
+        loadtest::run(opt);
+        return 0;
+    }
+
+    MusicPlayerFacade player;
+    player.prewarmDevices({DeviceType::BLUETOOTH, DeviceType::WIRED, DeviceType::HEADPHONES});
+
+    // Add songs
+    player.addSongToPlaylist(Song("Lose Yourself", "Eminem"));
+    player.addSongToPlaylist(Song("Bohemian Rhapsody", "Queen"));
+    player.addSongToPlaylist(Song("Blinding Lights", "The Weeknd"));
+    player.addSongToPlaylist(Song("Imagine", "John Lennon"));
+
+    // 1) Sequential on HEADPHONES
+    player.configure(DeviceType::HEADPHONES, PlayStrategyType::SEQUENTIAL);
+    player.playMultiple(4);
+
+    // 2) Random on BLUETOOTH
+    player.configure(DeviceType::BLUETOOTH, PlayStrategyType::RANDOM);
+    player.playMultiple(4);
+
+    // 3) Custom queue on WIRED
+    vector<size_t> order = {1, 0, 3, 2};
+    player.configureCustom(DeviceType::WIRED, order);
+    player.playMultiple(4);
+
+    // 4) Shuffle (no repeats within a round) on HEADPHONES
+    player.configure(DeviceType::HEADPHONES, PlayStrategyType::SHUFFLE);
+    player.playMultiple(4);
+
+    // 5) Statically dispatched engine: custom queue on WIRED
+    StaticAudioEngine<CustomQueueStrategy, WiredSpeakerAdapter> fixedEngine;
+    fixedEngine.getStrategy().setQueue({3, 2, 1, 0});
+    fixedEngine.loadPlaylist(player.getPlaylist());
+    fixedEngine.playMultiple(4);
+
+    // 6) Every song by one artist, found with a columnar scan, on BLUETOOTH
+    SongColumns columns(player.getPlaylist());
+    player.configureCustom(DeviceType::BLUETOOTH, columns.slotsByArtist("Queen"));
+    player.playMultiple(1);
+
+    // 7) Search results ("rhapsody", fuzzy "blindng lihgts") as a queue on HEADPHONES
+    vector<SearchHit> hits = player.search("rhapsody", 1);
+    vector<SearchHit> fuzzyHits = player.search("blindng lihgts", 1);
+    hits.insert(hits.end(), fuzzyHits.begin(), fuzzyHits.end());
+    player.configureCustom(DeviceType::HEADPHONES, SearchIndex::toQueue(player.getPlaylist(), hits));
+    player.playMultiple(2);
+
+    // 8) Sequential on WIRED, moved to HEADPHONES halfway through without a restart
+    player.configure(DeviceType::WIRED, PlayStrategyType::SEQUENTIAL);
+    player.playMultiple(2);
+    player.switchDevice(DeviceType::HEADPHONES);
+    player.playMultiple(2);
+
+    // 9) Streamed through a chunk cache on WIRED: the second pass is served from memory
+    ChunkCache chunks(16 << 20, simulatedBackend(64 << 10));
+    chunks.registerGauges("chunk_cache");
+    auto cached = DeviceFactory::createCached(DeviceType::WIRED, chunks);
+    for (int pass = 0; pass < 2; ++pass)
+        for (Song s : player.getPlaylist()) cached->playSound(s);
+
+    // One event-loop thread drives two sessions' output concurrently
+    EventLoop loop;
+    thread loopThread([&] { loop.run(); });
+    auto wired = DeviceFactory::createOnLoop(DeviceType::WIRED, loop);
+    auto headphones = DeviceFactory::createOnLoop(DeviceType::HEADPHONES, loop);
+    SequentialPlayStrategy wiredOrder, headphonesOrder;
+    int sessionsLeft = 2;
+    auto finished = [&](exception_ptr) { if (--sessionsLeft == 0) loop.stop(); };
+    loop.post([&] {
+        playOnLoop(*wired, player.getPlaylist(), wiredOrder, 2, finished);
+        playOnLoop(*headphones, player.getPlaylist(), headphonesOrder, 2, finished);
+    });
+    loopThread.join();
+
+#ifdef SPOTIFY_INSTRUMENT
+    player.playNext();
+    metrics::print(cout, metrics::snapshot());
+#endif
 
     return 0;
 }